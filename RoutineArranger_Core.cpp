@@ -1,48 +1,1197 @@
 #include "pch.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cwctype>
+#include <exception>
+#include <optional>
+#include <ppl.h>
+#include <queue>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
 
 #include "RoutineArranger_Core.h"
 #include "util.h"
 
-const uint64_t SECS_PER_DAY = 60 * 60 * 24;
+namespace RoutineArranger::Core::implementation {
+    // NOTE: Zero-length routines are treated as lasting for one second, so that
+    //       they can still be found by overlap queries
+    uint64_t routine_end_secs(uint64_t start, uint64_t duration) {
+        return util::num::saturating_add(start, std::max(duration, uint64_t{ 1 }));
+    }
+    // Whether routine (as updated by a user) differs from the public routine
+    // with the same id only in per-user state, which is then kept as a
+    // PublicRoutineOverride instead of a full copy
+    // NOTE: Templates are always copied, as occurrences derive from them
+    bool is_public_routine_override(RoutineDesc const& public_routine, RoutineDesc const& routine) {
+        return std::holds_alternative<std::nullptr_t>(public_routine.template_options) &&
+            std::holds_alternative<std::nullptr_t>(routine.template_options) &&
+            routine.start_secs_since_epoch == public_routine.start_secs_since_epoch &&
+            routine.duration_secs == public_routine.duration_secs &&
+            routine.color == public_routine.color &&
+            routine.end_trigger_kind == public_routine.end_trigger_kind &&
+            routine.name == public_routine.name &&
+            routine.description == public_routine.description;
+    }
+    // Makes a data segment exclusively owned by the model before modifying it
+    // NOTE: The caller must hold the (writer) lock of the segment, so that no
+    //       snapshot can start sharing it in the meantime
+    template<typename T>
+    T& detach_segment(std::shared_ptr<T>& segment) {
+        if (segment.use_count() != 1) {
+            segment = std::make_shared<T>(*segment);
+        }
+        else {
+            // Pairs with the release of the last snapshot which shared it
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        return *segment;
+    }
 
-template<typename Container, typename T, typename Pred>
-void ordered_insert(Container& c, T&& v, Pred pred) {
-    // TODO: Is UB possible if the next two lines are combined?
-    auto it = std::lower_bound(c.begin(), c.end(), v, pred);
-    c.insert(it, std::forward<T>(v));
-}
+    // Strips what a public routine cannot have
+    void normalize_public_routine(RoutineDesc& routine) {
+        routine.is_ghost = false;
+        // Public routine cannot be ended ones
+        routine.is_ended = false;
+        // Public routine cannot be derived ones
+        if (std::holds_alternative<RoutineDescTemplate_Derived>(routine.template_options)) {
+            routine.template_options = nullptr;
+        }
+    }
 
-namespace RoutineArranger::Core::implementation {
-    bool pred_routine_desc_less_than(RoutineDesc const& a, RoutineDesc const& b) {
-        return a.start_secs_since_epoch < b.start_secs_since_epoch;
+    UserDesc* UserDirectory::find(::winrt::guid const& id) {
+        auto it = m_id_index.find(id);
+        if (it == m_id_index.end()) {
+            return nullptr;
+        }
+        return &m_users[it->second];
+    }
+    UserDesc const* UserDirectory::find(::winrt::guid const& id) const {
+        auto it = m_id_index.find(id);
+        if (it == m_id_index.end()) {
+            return nullptr;
+        }
+        return &m_users[it->second];
+    }
+    std::vector<UserDesc const*> UserDirectory::ordered_users(void) const {
+        std::vector<size_t> order(m_users.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return m_sequences[a] < m_sequences[b];
+        });
+        std::vector<UserDesc const*> result;
+        result.reserve(order.size());
+        for (size_t i : order) {
+            result.push_back(&m_users[i]);
+        }
+        return result;
     }
-    bool pred_routine_is_ghost(RoutineDesc const& v) {
-        return v.is_ghost;
+    void UserDirectory::reserve(size_t new_cap) {
+        m_users.reserve(new_cap);
+        m_sequences.reserve(new_cap);
+        m_id_index.reserve(new_cap);
+        m_name_index.reserve(new_cap);
+    }
+    void UserDirectory::push_back(UserDesc user) {
+        m_id_index.emplace(user.id, m_users.size());
+        m_name_index.emplace(user.name, m_users.size());
+        m_users.push_back(std::move(user));
+        m_sequences.push_back(m_next_sequence++);
     }
-    bool pred_derived_routines_in_same_day(RoutineDesc const& a, RoutineDesc const& b) {
-        auto derived_a = std::get_if<RoutineDescTemplate_Derived>(&a.template_options);
-        auto derived_b = std::get_if<RoutineDescTemplate_Derived>(&b.template_options);
-        // Do not take non-derived routines into account
-        if (!(derived_a && derived_b)) {
+    bool UserDirectory::erase(::winrt::guid const& id) {
+        auto it = m_id_index.find(id);
+        if (it == m_id_index.end()) {
             return false;
         }
-        if (derived_a->source_routine != derived_b->source_routine) {
+        size_t pos = it->second;
+        m_id_index.erase(it);
+        m_name_index.erase(m_users[pos].name);
+        size_t last = m_users.size() - 1;
+        if (pos != last) {
+            m_users[pos] = std::move(m_users[last]);
+            m_sequences[pos] = m_sequences[last];
+            m_id_index[m_users[pos].id] = pos;
+            m_name_index[m_users[pos].name] = pos;
+        }
+        m_users.pop_back();
+        m_sequences.pop_back();
+        return true;
+    }
+    void UserDirectory::clear(void) {
+        m_users.clear();
+        m_sequences.clear();
+        m_next_sequence = 0;
+        m_id_index.clear();
+        m_name_index.clear();
+    }
+
+    void RoutineIntervalIndex::insert(uint64_t start, uint64_t end, uint32_t slot) {
+        auto it = std::lower_bound(
+            m_entries.begin(), m_entries.end(),
+            start,
+            [](Entry const& e, uint64_t const& v) {
+                return e.start < v;
+            }
+        );
+        m_entries.insert(it, Entry{ start, end, end, slot });
+        this->prepare();
+    }
+    bool RoutineIntervalIndex::erase(uint64_t start, uint32_t slot) {
+        auto it = m_entries.begin() + this->lower_bound(start);
+        for (; it != m_entries.end() && it->start == start; it++) {
+            if (it->slot == slot) {
+                m_entries.erase(it);
+                this->prepare();
+                return true;
+            }
+        }
+        return false;
+    }
+    void RoutineIntervalIndex::assign(std::vector<Entry> entries) {
+        // LSD radix sort on start time, one byte per pass; passes where all
+        // keys share the same byte (typically the high ones) are skipped
+        // NOTE: Small inputs are not worth the counting overhead
+        if (entries.size() < 256) {
+            std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) {
+                return a.start < b.start;
+            });
+        }
+        else {
+            std::vector<Entry> buffer(entries.size());
+            size_t counts[8][256]{};
+            for (auto const& i : entries) {
+                for (int pass = 0; pass < 8; pass++) {
+                    counts[pass][(i.start >> (pass * 8)) & 0xff]++;
+                }
+            }
+            for (int pass = 0; pass < 8; pass++) {
+                auto& count = counts[pass];
+                if (count[(entries.front().start >> (pass * 8)) & 0xff] == entries.size()) {
+                    continue;
+                }
+                size_t offset = 0;
+                for (auto& i : count) {
+                    offset += std::exchange(i, offset);
+                }
+                for (auto const& i : entries) {
+                    buffer[count[(i.start >> (pass * 8)) & 0xff]++] = i;
+                }
+                entries.swap(buffer);
+            }
+        }
+        m_entries = std::move(entries);
+        this->prepare();
+    }
+    void RoutineIntervalIndex::clear(void) {
+        m_entries.clear();
+        m_root_level = -1;
+    }
+    size_t RoutineIntervalIndex::lower_bound(uint64_t start) const {
+        auto it = std::lower_bound(
+            m_entries.begin(), m_entries.end(),
+            start,
+            [](Entry const& e, uint64_t const& v) {
+                return e.start < v;
+            }
+        );
+        return static_cast<size_t>(it - m_entries.begin());
+    }
+    void RoutineIntervalIndex::prepare(void) {
+        // Source: https://github.com/lh3/cgranges (implicit interval tree)
+        // Node i is at level k if the lowest k bits of i are all set; the
+        // root is at index (1 << root_level) - 1
+        auto const n = static_cast<int64_t>(m_entries.size());
+        if (n == 0) {
+            m_root_level = -1;
+            return;
+        }
+        int64_t last_i = 0;
+        uint64_t last = 0;
+        for (int64_t i = 0; i < n; i += 2) {
+            last_i = i;
+            last = m_entries[i].max_end = m_entries[i].end;
+        }
+        int level = 1;
+        for (; (int64_t{ 1 } << level) <= n; level++) {
+            int64_t x = int64_t{ 1 } << (level - 1);
+            for (int64_t i = (x << 1) - 1; i < n; i += x << 2) {
+                // NOTE: Right child may be out of range; use the last node instead
+                uint64_t end_left = m_entries[i - x].max_end;
+                uint64_t end_right = i + x < n ? m_entries[i + x].max_end : last;
+                m_entries[i].max_end = std::max({ m_entries[i].end, end_left, end_right });
+            }
+            last_i = (last_i >> level & 1) ? last_i - x : last_i + x;
+            if (last_i < n && m_entries[last_i].max_end > last) {
+                last = m_entries[last_i].max_end;
+            }
+        }
+        m_root_level = level - 1;
+    }
+
+    uint32_t RoutineTable::insert(RoutineDesc routine) {
+        uint64_t end = routine_end_secs(routine.start_secs_since_epoch, routine.duration_secs);
+        auto slot = this->place_slot(std::move(routine));
+        m_index.insert(m_starts[slot], end, slot);
+        return slot;
+    }
+    void RoutineTable::erase(uint32_t slot) {
+        m_index.erase(m_starts[slot], slot);
+        this->release_slot(slot);
+    }
+    void RoutineTable::apply_batch(std::vector<RoutineDesc> routines, std::vector<::winrt::guid> const& removed_ids) {
+        // Release replaced & removed routines first, marking their slots so
+        // that stale index entries can be dropped in the same pass as the
+        // merge (even if the slots are reused in the meantime)
+        std::vector<bool> erased_slots(m_slots.size());
+        auto release_fn = [&](::winrt::guid const& id) {
+            auto slot = this->find(id);
+            if (slot != UINT32_MAX) {
+                erased_slots[slot] = true;
+                this->release_slot(slot);
+            }
+        };
+        for (auto const& i : removed_ids) {
+            release_fn(i);
+        }
+        for (auto const& i : routines) {
+            release_fn(i.id);
+        }
+        std::vector<RoutineIntervalIndex::Entry> entries;
+        entries.reserve(routines.size());
+        for (auto& i : routines) {
+            uint64_t end = routine_end_secs(i.start_secs_since_epoch, i.duration_secs);
+            auto slot = this->place_slot(std::move(i));
+            entries.push_back({ m_starts[slot], end, end, slot });
+        }
+        m_index.erase_if_and_merge([&](RoutineIntervalIndex::Entry const& e) {
+            return e.slot < erased_slots.size() && erased_slots[e.slot];
+        }, std::move(entries));
+    }
+    void RoutineTable::assign(std::vector<RoutineDesc> routines) {
+        this->clear();
+        m_ids.reserve(routines.size());
+        m_starts.reserve(routines.size());
+        m_durations.reserve(routines.size());
+        m_colors.reserve(routines.size());
+        m_flags.reserve(routines.size());
+        m_slots.reserve(routines.size());
+        m_id_index.reserve(routines.size());
+        std::vector<RoutineIntervalIndex::Entry> entries;
+        entries.reserve(routines.size());
+        for (auto& i : routines) {
+            uint64_t end = routine_end_secs(i.start_secs_since_epoch, i.duration_secs);
+            auto slot = this->place_slot(std::move(i));
+            entries.push_back({ m_starts[slot], end, end, slot });
+        }
+        m_index.assign(std::move(entries));
+    }
+    uint32_t RoutineTable::place_slot(RoutineDesc routine) {
+        uint64_t start = routine.start_secs_since_epoch;
+        auto id = routine.id;
+        auto template_kind = static_cast<RoutineTemplateKind>(routine.template_options.index() + 1);
+        uint8_t flags = static_cast<uint8_t>(template_kind << FLAG_TEMPLATE_KIND_SHIFT);
+        if (routine.is_ended) {
+            flags |= FLAG_ENDED;
+        }
+        uint32_t slot;
+        if (!m_free_slots.empty()) {
+            slot = m_free_slots.back();
+            m_free_slots.pop_back();
+            m_ids[slot] = id;
+            m_starts[slot] = start;
+            m_durations[slot] = routine.duration_secs;
+            m_colors[slot] = routine.color;
+            m_flags[slot] = flags;
+            m_slots[slot] = std::move(routine);
+        }
+        else {
+            slot = static_cast<uint32_t>(m_slots.size());
+            m_ids.push_back(id);
+            m_starts.push_back(start);
+            m_durations.push_back(routine.duration_secs);
+            m_colors.push_back(routine.color);
+            m_flags.push_back(flags);
+            m_slots.push_back(std::move(routine));
+        }
+        m_id_index[id] = slot;
+        if (template_kind == RoutineTemplateKind::Repeating) {
+            m_repeating_index[routine_template_key(id)] = slot;
+            this->forget_occurrences(id);
+        }
+        else if (auto derived = std::get_if<RoutineDescTemplate_Derived>(&m_slots[slot].template_options)) {
+            m_derived_index[derived->source_routine][start / SECS_PER_DAY]++;
+        }
+        return slot;
+    }
+    void RoutineTable::clear(void) {
+        m_ids.clear();
+        m_starts.clear();
+        m_durations.clear();
+        m_colors.clear();
+        m_flags.clear();
+        m_slots.clear();
+        m_free_slots.clear();
+        m_index.clear();
+        m_id_index.clear();
+        m_repeating_index.clear();
+        m_derived_index.clear();
+        m_public_overrides.clear();
+        if (m_occurrence_cache) {
+            m_occurrence_cache = std::make_shared<OccurrenceCache>();
+        }
+    }
+    void RoutineTable::enable_occurrence_cache(void) {
+        if (!m_occurrence_cache) {
+            m_occurrence_cache = std::make_shared<OccurrenceCache>();
+        }
+    }
+    void RoutineTable::forget_occurrences(::winrt::guid const& source_id) {
+        if (m_occurrence_cache) {
+            // NOTE: Other copies of the table (e.g. pinned by snapshots) may
+            //       still share the cache; see detach_segment
+            detach_segment(m_occurrence_cache).erase(source_id);
+        }
+    }
+    void RoutineTable::release_slot(uint32_t slot) {
+        // NOTE: Corrupted storage may contain duplicate ids; only drop the
+        //       mapping if it still refers to this slot
+        auto it = m_id_index.find(m_ids[slot]);
+        if (it != m_id_index.end() && it->second == slot) {
+            m_id_index.erase(it);
+        }
+        if (this->template_kind(slot) == RoutineTemplateKind::Repeating) {
+            auto it2 = m_repeating_index.find(routine_template_key(m_ids[slot]));
+            if (it2 != m_repeating_index.end() && it2->second == slot) {
+                m_repeating_index.erase(it2);
+            }
+            this->forget_occurrences(m_ids[slot]);
+        }
+        else if (auto derived = std::get_if<RoutineDescTemplate_Derived>(&m_slots[slot].template_options)) {
+            // Only the days of the affected template are touched
+            auto it2 = m_derived_index.find(derived->source_routine);
+            auto it3 = it2->second.find(m_starts[slot] / SECS_PER_DAY);
+            if (--it3->second == 0) {
+                it2->second.erase(it3);
+                if (it2->second.empty()) {
+                    m_derived_index.erase(it2);
+                }
+            }
+        }
+        // Drop strings & template data early
+        m_flags[slot] = 0;
+        m_slots[slot] = RoutineDesc{};
+        m_free_slots.push_back(slot);
+    }
+
+    // Ghost ids are UUIDv8s derived from (template, day offset), so that they
+    // remain stable across queries and can be decoded without searching:
+    //     Data1, Data2, low 12 bits of Data3: template key (60 bits)
+    //     High 4 bits of Data3: version (8)
+    //     High 2 bits of Data4[0]: variant (0b10)
+    //     Low 6 bits of Data4[0], Data4[1..2]: check bits (22 bits)
+    //     Data4[3..7]: days since the start of the template (40 bits)
+    const uint64_t GHOST_ID_MAX_DAY_OFFSET = (uint64_t{ 1 } << 40) - 1;
+    uint32_t ghost_routine_id_check_bits(uint64_t template_key, uint64_t day_offset) {
+        return static_cast<uint32_t>(mix_u64(template_key ^ mix_u64(day_offset)) & 0x3fffff);
+    }
+    ::winrt::guid make_ghost_routine_id(::winrt::guid const& source_id, uint64_t day_offset) {
+        uint64_t key = routine_template_key(source_id);
+        uint32_t check = ghost_routine_id_check_bits(key, day_offset);
+        GUID id;
+        id.Data1 = static_cast<uint32_t>(key >> 28);
+        id.Data2 = static_cast<uint16_t>(key >> 12);
+        id.Data3 = static_cast<uint16_t>(0x8000 | (key & 0x0fff));
+        id.Data4[0] = static_cast<uint8_t>(0x80 | (check >> 16));
+        id.Data4[1] = static_cast<uint8_t>(check >> 8);
+        id.Data4[2] = static_cast<uint8_t>(check);
+        for (int i = 0; i < 5; i++) {
+            id.Data4[3 + i] = static_cast<uint8_t>(day_offset >> (8 * (4 - i)));
+        }
+        return id;
+    }
+    bool try_parse_ghost_routine_id(::winrt::guid const& id, uint64_t& template_key, uint64_t& day_offset) {
+        if ((id.Data3 >> 12) != 0x8 || (id.Data4[0] & 0xc0) != 0x80) {
             return false;
         }
-        uint64_t ta = a.start_secs_since_epoch / SECS_PER_DAY;
-        uint64_t tb = b.start_secs_since_epoch / SECS_PER_DAY;
-        if (ta != tb) {
+        uint64_t key = (uint64_t{ id.Data1 } << 28) | (uint64_t{ id.Data2 } << 12) | (id.Data3 & 0x0fff);
+        uint64_t offset = 0;
+        for (int i = 0; i < 5; i++) {
+            offset = (offset << 8) | id.Data4[3 + i];
+        }
+        uint32_t check = (uint32_t{ id.Data4[0] & 0x3fu } << 16) | (uint32_t{ id.Data4[1] } << 8) | id.Data4[2];
+        if (check != ghost_routine_id_check_bits(key, offset)) {
             return false;
         }
+        template_key = key;
+        day_offset = offset;
         return true;
     }
+    // Whether a repeating template derives a routine after day_offset days
+    bool is_repeating_occurrence(RoutineDesc const& source, uint64_t day_offset) {
+        auto const& repeating = std::get<RoutineDescTemplate_Repeating>(source.template_options);
+        if (day_offset == 0 || repeating.repeat_days_cycle == 0) {
+            return false;
+        }
+        uint64_t cycle = day_offset / repeating.repeat_days_cycle;
+        uint64_t day = day_offset % repeating.repeat_days_cycle;
+        if (repeating.repeat_cycles != 0 && cycle >= repeating.repeat_cycles) {
+            return false;
+        }
+        return day < repeating.repeat_days_flags.size() && repeating.repeat_days_flags[day];
+    }
+
+    // Enumerates occurrences derived from a repeating template in ascending
+    // order of start time
+    // NOTE: The template itself (first day of the first cycle) is excluded
+    struct RepeatingOccurrenceCursor {
+        RepeatingOccurrenceCursor(RoutineDesc const& source) :
+            m_source(&source), m_repeating(&std::get<RoutineDescTemplate_Repeating>(source.template_options)),
+            m_cycle(0), m_day(0), m_start(source.start_secs_since_epoch), m_valid(false)
+        {
+            auto const& flags = m_repeating->repeat_days_flags;
+            // Templates without any flag set never derive routines
+            m_valid = flags.find_next(0) < std::min(size_t{ m_repeating->repeat_days_cycle }, flags.size());
+            this->next();
+        }
+
+        RoutineDesc const& source(void) const { return *m_source; }
+        bool valid(void) const { return m_valid; }
+        uint64_t start(void) const { return m_start; }
+        uint64_t day_offset(void) const { return (m_start - m_source->start_secs_since_epoch) / SECS_PER_DAY; }
+        void next(void) {
+            if (!m_valid) {
+                return;
+            }
+            auto const& flags = m_repeating->repeat_days_flags;
+            size_t days = std::min(static_cast<size_t>(m_repeating->repeat_days_cycle), flags.size());
+            // Jump to the next set flag, wrapping around to the next cycle
+            size_t day = flags.find_next(size_t{ m_day } + 1);
+            if (day >= days) {
+                day = flags.find_next(0);
+                m_cycle++;
+            }
+            m_day = static_cast<uint32_t>(day);
+            // NOTE: repeat_cycles == 0 means repeating infinite times
+            if (m_repeating->repeat_cycles != 0 && m_cycle >= m_repeating->repeat_cycles) {
+                m_valid = false;
+                return;
+            }
+            uint64_t offset_days = util::num::saturating_add(
+                util::num::saturating_mul(m_cycle, uint64_t{ m_repeating->repeat_days_cycle }),
+                uint64_t{ m_day }
+            );
+            m_start = util::num::saturating_add(
+                m_source->start_secs_since_epoch,
+                util::num::saturating_mul(offset_days, SECS_PER_DAY)
+            );
+            // NOTE: Ghost ids cannot encode larger offsets
+            if (m_start == std::numeric_limits<uint64_t>::max() || offset_days > GHOST_ID_MAX_DAY_OFFSET) {
+                m_valid = false;
+            }
+        }
+        // Skips all occurrences which end no later than secs
+        // NOTE: Jumps directly to the first relevant cycle, so that the cost
+        //       does not grow with the age of the template
+        void skip_until(uint64_t secs) {
+            if (!m_valid) {
+                return;
+            }
+            uint64_t duration = std::max(m_source->duration_secs, uint64_t{ 1 });
+            uint64_t cycle_secs = uint64_t{ m_repeating->repeat_days_cycle } * SECS_PER_DAY;
+            // Occurrences starting before this point end no later than secs
+            uint64_t min_start = secs >= duration ? secs - duration + 1 : 0;
+            if (min_start > m_source->start_secs_since_epoch) {
+                uint64_t first_cycle = (min_start - m_source->start_secs_since_epoch) / cycle_secs;
+                if (first_cycle > m_cycle) {
+                    if (m_repeating->repeat_cycles != 0 && first_cycle >= m_repeating->repeat_cycles) {
+                        m_valid = false;
+                        return;
+                    }
+                    // Resume from the last day of the previous cycle
+                    m_cycle = first_cycle - 1;
+                    m_day = m_repeating->repeat_days_cycle - 1;
+                    this->next();
+                }
+            }
+            // No more than two cycles are walked through here
+            while (m_valid && routine_end_secs(m_start, m_source->duration_secs) <= secs) {
+                this->next();
+            }
+        }
+    private:
+        RoutineDesc const* m_source;
+        RoutineDescTemplate_Repeating const* m_repeating;
+        uint64_t m_cycle;
+        uint32_t m_day;
+        uint64_t m_start;
+        bool m_valid;
+    };
+
+    const uint64_t OCCURRENCE_CACHE_BUCKET_SECS = 32 * SECS_PER_DAY;
+    // NOTE: The whole cache is dropped once it grows beyond this
+    const size_t OCCURRENCE_CACHE_MAX_BUCKETS = 1 << 16;
+    // NOTE: Queries spanning more buckets (e.g. searching over years) enumerate
+    //       occurrences on the fly instead, so as not to flood the cache
+    const uint64_t OCCURRENCE_CACHE_MAX_BUCKETS_PER_QUERY = 16;
+
+    OccurrenceCache::OccurrenceCache(OccurrenceCache const& other) : m_mutex(), m_entries(), m_buckets_count(0) {
+        std::shared_lock guard{ other.m_mutex };
+        m_entries = other.m_entries;
+        m_buckets_count = other.m_buckets_count;
+    }
+    std::shared_ptr<OccurrenceCache::Bucket const> OccurrenceCache::get(RoutineDesc const& source, uint64_t bucket) {
+        {
+            std::shared_lock guard{ m_mutex };
+            auto it = m_entries.find(source.id);
+            if (it != m_entries.end()) {
+                auto it2 = it->second.find(bucket);
+                if (it2 != it->second.end()) {
+                    return it2->second;
+                }
+            }
+        }
+        // NOTE: Expanded outside of the lock; racing readers may expand the
+        //       same bucket twice, in which case the first result is kept
+        auto result = std::make_shared<Bucket>();
+        uint64_t start = bucket_start(bucket);
+        uint64_t end = bucket_start(bucket + 1);
+        RepeatingOccurrenceCursor cursor{ source };
+        cursor.skip_until(start);
+        for (; cursor.valid() && cursor.start() < end; cursor.next()) {
+            if (cursor.start() >= start) {
+                result->push_back({ cursor.start(), make_ghost_routine_id(source.id, cursor.day_offset()) });
+            }
+        }
+        std::unique_lock guard{ m_mutex };
+        if (m_buckets_count >= OCCURRENCE_CACHE_MAX_BUCKETS) {
+            m_entries.clear();
+            m_buckets_count = 0;
+        }
+        auto [it, inserted] = m_entries[source.id].emplace(bucket, std::move(result));
+        if (inserted) {
+            m_buckets_count++;
+        }
+        return it->second;
+    }
+    void OccurrenceCache::erase(::winrt::guid const& source_id) {
+        std::unique_lock guard{ m_mutex };
+        auto it = m_entries.find(source_id);
+        if (it != m_entries.end()) {
+            m_buckets_count -= it->second.size();
+            m_entries.erase(it);
+        }
+    }
+    uint64_t OccurrenceCache::bucket_of(uint64_t secs_since_epoch) {
+        return secs_since_epoch / OCCURRENCE_CACHE_BUCKET_SECS;
+    }
+    uint64_t OccurrenceCache::bucket_start(uint64_t bucket) {
+        return util::num::saturating_mul(bucket, OCCURRENCE_CACHE_BUCKET_SECS);
+    }
+
+    bool ExpiryQueue::is_expiring(RoutineDesc const& routine) {
+        return (routine.end_trigger_kind & RoutineEndTriggerKind::Expiry) && !routine.is_ended &&
+            !routine.is_ghost && !std::holds_alternative<RoutineDescTemplate_Repeating>(routine.template_options);
+    }
+    void ExpiryQueue::schedule(RoutineDesc const& routine) {
+        if (!is_expiring(routine)) {
+            this->cancel(routine.id);
+            return;
+        }
+        auto cmp_fn = [](Entry const& a, Entry const& b) { return a.end_secs_since_epoch > b.end_secs_since_epoch; };
+        uint64_t end = routine_end_secs(routine.start_secs_since_epoch, routine.duration_secs);
+        auto [it, inserted] = m_ends.try_emplace(routine.id, end);
+        if (!inserted) {
+            if (it->second == end) {
+                return;
+            }
+            it->second = end;
+        }
+        m_heap.push_back({ end, routine.id });
+        std::push_heap(m_heap.begin(), m_heap.end(), cmp_fn);
+        this->compact_if_needed();
+    }
+    void ExpiryQueue::cancel(::winrt::guid const& routine_id) {
+        if (m_ends.erase(routine_id) > 0) {
+            this->compact_if_needed();
+        }
+    }
+    uint64_t ExpiryQueue::next_end(void) const {
+        return m_heap.empty() ? UINT64_MAX : m_heap.front().end_secs_since_epoch;
+    }
+    std::vector<ExpiryQueue::Entry> ExpiryQueue::take_due(uint64_t now_secs_since_epoch) {
+        auto cmp_fn = [](Entry const& a, Entry const& b) { return a.end_secs_since_epoch > b.end_secs_since_epoch; };
+        std::vector<Entry> result;
+        while (!m_heap.empty() && m_heap.front().end_secs_since_epoch <= now_secs_since_epoch) {
+            std::pop_heap(m_heap.begin(), m_heap.end(), cmp_fn);
+            Entry entry = m_heap.back();
+            m_heap.pop_back();
+            auto it = m_ends.find(entry.routine_id);
+            if (it == m_ends.end() || it->second != entry.end_secs_since_epoch) {
+                // Stale
+                continue;
+            }
+            m_ends.erase(it);
+            result.push_back(entry);
+        }
+        return result;
+    }
+    void ExpiryQueue::compact_if_needed(void) {
+        // NOTE: Rebuilding costs as much as the stale entries being dropped
+        if (m_heap.size() <= 64 || m_heap.size() <= m_ends.size() * 2) {
+            return;
+        }
+        m_heap.clear();
+        m_heap.reserve(m_ends.size());
+        for (auto const& [routine_id, end] : m_ends) {
+            m_heap.push_back({ end, routine_id });
+        }
+        std::make_heap(m_heap.begin(), m_heap.end(),
+            [](Entry const& a, Entry const& b) { return a.end_secs_since_epoch > b.end_secs_since_epoch; }
+        );
+    }
+
+    // Occurrences of a repeating template overlapping [start, end), in
+    // ascending order of start time; read from the occurrence cache if
+    // there is one, or enumerated on the fly otherwise
+    struct OccurrenceStream {
+        OccurrenceStream(RoutineDesc const& source, OccurrenceCache* cache, uint64_t start, uint64_t end) :
+            m_cursor(source), m_end(end), m_min_start(0), m_buckets(), m_bucket_idx(0), m_pos(0)
+        {
+            if (start >= end) {
+                // Nothing overlaps an empty range
+                // NOTE: valid() never holds with m_end == 0
+                m_end = 0;
+                return;
+            }
+            uint64_t duration = std::max(source.duration_secs, uint64_t{ 1 });
+            // Occurrences starting before this point end no later than start
+            m_min_start = start >= duration ? start - duration + 1 : 0;
+            if (!m_cursor.valid()) {
+                return;
+            }
+            uint64_t first_bucket = OccurrenceCache::bucket_of(m_min_start);
+            uint64_t last_bucket = OccurrenceCache::bucket_of(end - 1);
+            if (cache == nullptr || last_bucket - first_bucket >= OCCURRENCE_CACHE_MAX_BUCKETS_PER_QUERY) {
+                m_cursor.skip_until(start);
+                return;
+            }
+            for (auto i = first_bucket; i <= last_bucket; i++) {
+                m_buckets.push_back(cache->get(source, i));
+            }
+            this->skip_exhausted();
+        }
+
+        bool valid(void) const {
+            if (m_buckets.empty()) {
+                return m_cursor.valid() && m_cursor.start() < m_end;
+            }
+            return m_bucket_idx < m_buckets.size() && this->start() < m_end;
+        }
+        uint64_t start(void) const {
+            if (m_buckets.empty()) {
+                return m_cursor.start();
+            }
+            return (*m_buckets[m_bucket_idx])[m_pos].start_secs_since_epoch;
+        }
+        // Id of the ghost derived at this occurrence
+        ::winrt::guid id(void) const {
+            if (m_buckets.empty()) {
+                return make_ghost_routine_id(m_cursor.source().id, m_cursor.day_offset());
+            }
+            return (*m_buckets[m_bucket_idx])[m_pos].id;
+        }
+        void next(void) {
+            if (m_buckets.empty()) {
+                m_cursor.next();
+                return;
+            }
+            m_pos++;
+            this->skip_exhausted();
+        }
+    private:
+        // Moves to the next occurrence overlapping the range, if any
+        void skip_exhausted(void) {
+            for (; m_bucket_idx < m_buckets.size(); m_bucket_idx++, m_pos = 0) {
+                auto const& bucket = *m_buckets[m_bucket_idx];
+                while (m_pos < bucket.size() && bucket[m_pos].start_secs_since_epoch < m_min_start) {
+                    m_pos++;
+                }
+                if (m_pos < bucket.size()) {
+                    return;
+                }
+            }
+        }
+
+        RepeatingOccurrenceCursor m_cursor;
+        uint64_t m_end, m_min_start;
+        std::vector<std::shared_ptr<OccurrenceCache::Bucket const>> m_buckets;
+        size_t m_bucket_idx, m_pos;
+    };
+
+    // Entries of an interval index overlapping [start, end), in ascending
+    // order of start time
+    // NOTE: Only entries already ongoing at start are looked up through the
+    //       interval tree; the rest are walked lazily, so that the cost of an
+    //       unbounded range depends on how far it is walked
+    struct OverlappingEntryStream {
+        OverlappingEntryStream(RoutineIntervalIndex const& index, uint64_t start, uint64_t end) :
+            m_entries(&index.entries()), m_ongoing(), m_ongoing_pos(0), m_pos(index.lower_bound(start)), m_end(end)
+        {
+            if (start >= end) {
+                m_pos = m_entries->size();
+                return;
+            }
+            if (start > 0) {
+                index.for_each_overlapping(start - 1, start, [&](RoutineIntervalIndex::Entry const& e) {
+                    if (e.end > start) {
+                        m_ongoing.push_back(&e);
+                    }
+                });
+            }
+        }
+
+        bool valid(void) const {
+            return m_ongoing_pos < m_ongoing.size() ||
+                (m_pos < m_entries->size() && (*m_entries)[m_pos].start < m_end);
+        }
+        RoutineIntervalIndex::Entry const& entry(void) const {
+            return m_ongoing_pos < m_ongoing.size() ? *m_ongoing[m_ongoing_pos] : (*m_entries)[m_pos];
+        }
+        void next(void) {
+            if (m_ongoing_pos < m_ongoing.size()) {
+                m_ongoing_pos++;
+            }
+            else {
+                m_pos++;
+            }
+        }
+    private:
+        std::vector<RoutineIntervalIndex::Entry> const* m_entries;
+        // NOTE: In ascending order of start time, all starting before the range
+        std::vector<RoutineIntervalIndex::Entry const*> m_ongoing;
+        size_t m_ongoing_pos;
+        size_t m_pos;
+        uint64_t m_end;
+    };
+
+    // Expands the view of a user within [start, end) without materializing
+    // ghosts. Concrete routines, public routines and occurrences of repeating
+    // templates are merged as sorted streams, and fn(RoutineView const&)
+    // is called in ascending order of start time.
+    // NOTE: If fn returns bool, returning false stops the expansion; with an
+    //       unbounded range, the cost then depends on the number of routines
+    //       visited and the number of repeating templates only
+    // NOTE: Neither table is modified
+    // NOTE: Nothing is visited if start >= end
+    template<typename Fn>
+    void expand_user_routines(
+        RoutineTable const& user_routines,
+        RoutineTable const& public_routines,
+        uint64_t start, uint64_t end,
+        Fn&& fn
+    ) {
+        if (start >= end) {
+            return;
+        }
+        // NOTE: Only the hot columns are scanned here; the payload of a
+        //       routine is never touched unless it is a repeating template
+        OverlappingEntryStream concrete_stream{ user_routines.index(), start, end };
+        OverlappingEntryStream public_stream{ public_routines.index(), start, end };
+        // Public routines copied by the user (same id) are concrete
+        auto skip_copied_fn = [&] {
+            while (public_stream.valid() && user_routines.contains(public_routines.id(public_stream.entry().slot))) {
+                public_stream.next();
+            }
+        };
+        skip_copied_fn();
+        // NOTE: Occurrences of public templates come from the cache shared
+        //       by all users (if any); only the concretization checks below
+        //       are done per user
+        std::vector<OccurrenceStream> cursors;
+        std::vector<RoutineView> cursor_views;
+        std::vector<RoutineTable::DerivedDays const*> derived_days;
+        auto add_cursor_fn = [&](RoutineTable const& table, uint32_t slot) {
+            if (table.start_secs(slot) >= end) {
+                return;
+            }
+            OccurrenceStream cursor{ table[slot], table.occurrence_cache(), start, end };
+            if (cursor.valid()) {
+                cursors.push_back(std::move(cursor));
+                cursor_views.push_back(table.view(slot, RoutineViewKind::DerivedGhost));
+                derived_days.push_back(user_routines.find_derived_days(table.id(slot)));
+            }
+        };
+        for (auto const& [key, slot] : user_routines.repeating_index()) {
+            add_cursor_fn(user_routines, slot);
+        }
+        for (auto const& [key, slot] : public_routines.repeating_index()) {
+            if (!user_routines.contains(public_routines.id(slot))) {
+                add_cursor_fn(public_routines, slot);
+            }
+        }
+
+        // K-way merge; stream 0 & 1 are concrete & public routines, the rest
+        // are cursors
+        using HeapItem = std::pair<uint64_t, size_t>;
+        std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+        if (concrete_stream.valid()) {
+            heap.emplace(concrete_stream.entry().start, 0);
+        }
+        if (public_stream.valid()) {
+            heap.emplace(public_stream.entry().start, 1);
+        }
+        for (size_t i = 0; i < cursors.size(); i++) {
+            heap.emplace(cursors[i].start(), i + 2);
+        }
+        bool stopped = false;
+        auto emit_fn = [&](RoutineView const& v) {
+            if constexpr (std::is_same_v<std::invoke_result_t<Fn&, RoutineView const&>, bool>) {
+                stopped = !fn(v);
+            }
+            else {
+                fn(v);
+            }
+        };
+        while (!heap.empty() && !stopped) {
+            auto [secs, stream] = heap.top();
+            heap.pop();
+            if (stream == 0) {
+                emit_fn(user_routines.view(concrete_stream.entry().slot, RoutineViewKind::Concrete));
+                concrete_stream.next();
+                if (concrete_stream.valid()) {
+                    heap.emplace(concrete_stream.entry().start, stream);
+                }
+            }
+            else if (stream == 1) {
+                uint32_t slot = public_stream.entry().slot;
+                auto view = public_routines.view(slot, RoutineViewKind::PublicGhost);
+                // Overridden ones are concrete as well, but still share the payload
+                if (auto value = user_routines.find_public_override(public_routines.id(slot))) {
+                    view.kind = RoutineViewKind::Concrete;
+                    view.is_ended = value->is_ended;
+                }
+                emit_fn(view);
+                public_stream.next();
+                skip_copied_fn();
+                if (public_stream.valid()) {
+                    heap.emplace(public_stream.entry().start, stream);
+                }
+            }
+            else {
+                auto& cursor = cursors[stream - 2];
+                auto cursor_derived_days = derived_days[stream - 2];
+                // Skip occurrences which have been concretized (possibly moved
+                // to another day while keeping the ghost id)
+                bool is_concretized =
+                    (cursor_derived_days && cursor_derived_days->count(secs / SECS_PER_DAY) > 0) ||
+                    user_routines.contains(cursor.id());
+                if (!is_concretized) {
+                    auto& view = cursor_views[stream - 2];
+                    view.start_secs_since_epoch = secs;
+                    emit_fn(view);
+                }
+                cursor.next();
+                if (cursor.valid()) {
+                    heap.emplace(cursor.start(), stream);
+                }
+            }
+        }
+    }
+
+    // Finds the template of a ghost visible to the user
+    // NOTE: Returns nullptr if routine_id does not refer to such a ghost
+    RoutineDesc const* find_ghost_routine_source(
+        RoutineTable const& user_routines,
+        RoutineTable const& public_routines,
+        ::winrt::guid const& routine_id,
+        uint64_t& day_offset
+    ) {
+        uint64_t key;
+        if (!try_parse_ghost_routine_id(routine_id, key, day_offset)) {
+            return nullptr;
+        }
+        RoutineDesc const* source = nullptr;
+        if (auto slot = user_routines.find_repeating(key); slot != UINT32_MAX) {
+            source = &user_routines[slot];
+        }
+        else if (auto slot = public_routines.find_repeating(key); slot != UINT32_MAX) {
+            // Public templates used by the user are shadowed by personal ones
+            if (!user_routines.contains(public_routines[slot].id)) {
+                source = &public_routines[slot];
+            }
+        }
+        // NOTE: Template keys may collide; verify the whole id
+        if (source == nullptr || make_ghost_routine_id(source->id, day_offset) != routine_id) {
+            return nullptr;
+        }
+        if (!is_repeating_occurrence(*source, day_offset)) {
+            return nullptr;
+        }
+        return source;
+    }
+
+    // Accumulates free periods as results of a FreeSlotQuery
+    struct FreeSlotCollector {
+        FreeSlotCollector(FreeSlotQuery const& query) :
+            m_query(query), m_min_duration(std::max(query.min_duration_secs, uint64_t{ 1 })),
+            m_day_begin(std::min(uint64_t{ query.day_secs_begin }, SECS_PER_DAY)),
+            m_day_end(std::min(uint64_t{ query.day_secs_end }, SECS_PER_DAY))
+        {}
+
+        bool full(void) const {
+            return m_query.max_count != 0 && m_slots.size() >= m_query.max_count;
+        }
+        // Reports a free period, split by working hours if required
+        void add_free(uint64_t start, uint64_t end) {
+            if (m_day_begin >= m_day_end) {
+                this->add_slot(start, end);
+                return;
+            }
+            // NOTE: Local days are computed in signed arithmetic, as the time
+            //       zone offset may be negative
+            int64_t local_start = static_cast<int64_t>(start) + m_query.tz_offset_secs;
+            int64_t local_end = static_cast<int64_t>(end) + m_query.tz_offset_secs;
+            int64_t day_secs = static_cast<int64_t>(SECS_PER_DAY);
+            int64_t first_day = local_start >= 0 ? local_start / day_secs : (local_start + 1) / day_secs - 1;
+            for (int64_t day = first_day; day * day_secs < local_end && !this->full(); day++) {
+                int64_t begin = std::max(local_start, day * day_secs + static_cast<int64_t>(m_day_begin));
+                int64_t finish = std::min(local_end, day * day_secs + static_cast<int64_t>(m_day_end));
+                if (begin < finish) {
+                    this->add_slot(
+                        static_cast<uint64_t>(begin - m_query.tz_offset_secs),
+                        static_cast<uint64_t>(finish - m_query.tz_offset_secs)
+                    );
+                }
+            }
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> take(void) {
+            return std::move(m_slots);
+        }
+    private:
+        void add_slot(uint64_t start, uint64_t end) {
+            if (end - start >= m_min_duration && !this->full()) {
+                m_slots.emplace_back(start, end);
+            }
+        }
+
+        FreeSlotQuery const& m_query;
+        uint64_t m_min_duration;
+        uint64_t m_day_begin, m_day_end;
+        std::vector<std::pair<uint64_t, uint64_t>> m_slots;
+    };
+
+    // Merged busy periods of a user within [start, end), in ascending order
+    std::vector<std::pair<uint64_t, uint64_t>> collect_busy_periods(
+        RoutineTable const& user_routines,
+        RoutineTable const& public_routines,
+        uint64_t start,
+        uint64_t end
+    ) {
+        std::vector<std::pair<uint64_t, uint64_t>> periods;
+        expand_user_routines(
+            user_routines, public_routines, start, end,
+            [&](RoutineView const& v) {
+                uint64_t period_start = std::max(start, v.start_secs_since_epoch);
+                uint64_t period_end = std::min(end, routine_end_secs(v.start_secs_since_epoch, v.duration_secs));
+                if (!periods.empty() && period_start <= periods.back().second) {
+                    periods.back().second = std::max(periods.back().second, period_end);
+                }
+                else {
+                    periods.emplace_back(period_start, period_end);
+                }
+            }
+        );
+        return periods;
+    }
+
+    // Places tasks into the free periods left between busy ones (sorted and
+    // disjoint), earliest deadline first; starts[i] receives the start of
+    // tasks[i], or UINT64_MAX if it cannot be placed
+    // NOTE: Free periods are kept in an ordered map and split as tasks are
+    //       placed, so each placement only searches from its earliest start
+    std::vector<uint64_t> arrange_flexible_tasks(
+        std::vector<std::pair<uint64_t, uint64_t>> const& busy,
+        uint64_t window_start,
+        uint64_t window_end,
+        std::vector<FlexibleTaskDesc> const& tasks
+    ) {
+        std::map<uint64_t, uint64_t> free_periods;
+        uint64_t free_start = window_start;
+        for (auto const& [start, end] : busy) {
+            if (start > free_start) {
+                free_periods.emplace_hint(free_periods.end(), free_start, start);
+            }
+            free_start = std::max(free_start, end);
+        }
+        if (free_start < window_end) {
+            free_periods.emplace_hint(free_periods.end(), free_start, window_end);
+        }
+
+        std::vector<size_t> order(tasks.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            auto const& ta = tasks[a];
+            auto const& tb = tasks[b];
+            if (ta.deadline_secs_since_epoch != tb.deadline_secs_since_epoch) {
+                return ta.deadline_secs_since_epoch < tb.deadline_secs_since_epoch;
+            }
+            return ta.earliest_start_secs_since_epoch < tb.earliest_start_secs_since_epoch;
+        });
+
+        std::vector<uint64_t> starts(tasks.size(), UINT64_MAX);
+        for (size_t idx : order) {
+            auto const& task = tasks[idx];
+            uint64_t earliest = task.earliest_start_secs_since_epoch;
+            uint64_t deadline = task.deadline_secs_since_epoch;
+            // NOTE: Zero-length tasks still occupy one second, like routines
+            uint64_t length = std::max(task.duration_secs, uint64_t{ 1 });
+            // First free period ending after the earliest start
+            auto it = free_periods.upper_bound(earliest);
+            if (it != free_periods.begin() && std::prev(it)->second > earliest) {
+                --it;
+            }
+            for (; it != free_periods.end(); ++it) {
+                uint64_t start = std::max(it->first, earliest);
+                uint64_t end = util::num::saturating_add(start, length);
+                if (end > deadline) {
+                    // Later periods start even later
+                    break;
+                }
+                if (end > it->second) {
+                    continue;
+                }
+                starts[idx] = start;
+                uint64_t period_start = it->first, period_end = it->second;
+                it = free_periods.erase(it);
+                if (end < period_end) {
+                    it = free_periods.emplace_hint(it, end, period_end);
+                }
+                if (period_start < start) {
+                    free_periods.emplace_hint(it, period_start, start);
+                }
+                break;
+            }
+        }
+        return starts;
+    }
+
+    // NOTE: Below this much work (roughly, routines to be walked), handing
+    //       it out to the thread pool costs more than it saves
+    const size_t PARALLEL_MIN_WORK = 4096;
+
+    // Calls fn(i) for every i in [0, count), spread across the threads of the
+    // Concurrency Runtime pool if there is enough work, or serially otherwise
+    // NOTE: fn must be safe to call concurrently for different indices
+    // NOTE: If fn throws, the remaining calls are cancelled, and the
+    //       exception is rethrown on the calling thread
+    template<typename Fn>
+    void parallel_for_each_index(size_t count, size_t work, Fn&& fn) {
+        if (count < 2 || work < PARALLEL_MIN_WORK) {
+            for (size_t i = 0; i < count; i++) {
+                fn(i);
+            }
+            return;
+        }
+        // NOTE: The pool is shared by the whole process and kept alive, so
+        //       no thread is created per query
+        concurrency::parallel_for(size_t{ 0 }, count, [&](size_t i) { fn(i); });
+    }
+
+    // NOTE: Per user
+    const size_t RANGE_RESULT_CACHE_CAPACITY = 64;
+    // NOTE: Day and week views of the same week share a single entry
+    const uint64_t RANGE_RESULT_CACHE_BUCKET_SECS = 7 * SECS_PER_DAY;
+
+    RangeResultCache::RangeResultCache() : m_mutex(), m_lru(), m_index(), m_hits(0), m_misses(0) {}
+    RangeResultCache::Key RangeResultCache::bucket_range(uint64_t start, uint64_t end) {
+        uint64_t bucket_end = end / RANGE_RESULT_CACHE_BUCKET_SECS * RANGE_RESULT_CACHE_BUCKET_SECS;
+        if (bucket_end < end) {
+            bucket_end = util::num::saturating_add(bucket_end, RANGE_RESULT_CACHE_BUCKET_SECS);
+        }
+        return Key{ start / RANGE_RESULT_CACHE_BUCKET_SECS * RANGE_RESULT_CACHE_BUCKET_SECS, bucket_end };
+    }
+    std::shared_ptr<RangeResultCache::Routines const> RangeResultCache::find(Key const& key, RoutineEpochs const& epochs) {
+        std::lock_guard guard{ m_mutex };
+        auto it = m_index.find(key);
+        if (it == m_index.end() || !(it->second->epochs == epochs)) {
+            m_misses++;
+            return nullptr;
+        }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        m_hits++;
+        return it->second->value;
+    }
+    void RangeResultCache::insert(Key const& key, RoutineEpochs const& epochs, std::shared_ptr<Routines const> value) {
+        std::lock_guard guard{ m_mutex };
+        auto it = m_index.find(key);
+        if (it != m_index.end()) {
+            it->second->epochs = epochs;
+            it->second->value = std::move(value);
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            return;
+        }
+        m_lru.push_front(Entry{ key, epochs, std::move(value) });
+        m_index.emplace(key, m_lru.begin());
+        if (m_lru.size() > RANGE_RESULT_CACHE_CAPACITY) {
+            m_index.erase(m_lru.back().key);
+            m_lru.pop_back();
+        }
+    }
+
+    // Counts routine in the summaries of the days it overlaps within
+    // [start, end), where summaries[0] is the day starting at start
+    void add_to_day_summaries(
+        std::vector<RoutineDaySummary>& summaries,
+        uint64_t start, uint64_t end,
+        uint64_t routine_start, uint64_t routine_duration,
+        bool is_ended, uint32_t color
+    ) {
+        // Days in [first_day, last_day] overlapped by the routine
+        uint64_t overlap_start = std::max(routine_start, start);
+        uint64_t overlap_end = std::min(routine_end_secs(routine_start, routine_duration), end);
+        uint64_t first_day = (overlap_start - start) / SECS_PER_DAY;
+        uint64_t last_day = (overlap_end - 1 - start) / SECS_PER_DAY;
+        for (uint64_t day = first_day; day <= last_day; day++) {
+            auto& summary = summaries[day];
+            summary.total_count++;
+            if (is_ended) {
+                summary.ended_count++;
+            }
+            summary.colors.push_back(color);
+        }
+    }
+
+    // NOTE: Public routines are viewed by all users; share their expansion
+    std::shared_ptr<RoutineTable> make_public_routine_table(RoutineTable routines) {
+        auto table = std::make_shared<RoutineTable>(std::move(routines));
+        table->enable_occurrence_cache();
+        return table;
+    }
+
+    CoreAppModelSnapshot::CoreAppModelSnapshot(
+        std::shared_ptr<UserDirectory const> users,
+        std::shared_ptr<RoutineTable const> routines_public,
+        std::shared_ptr<PersonalRoutineTables const> routines_personal
+    ) :
+        m_users(std::move(users)), m_routines_public(std::move(routines_public)),
+        m_routines_personal(std::move(routines_personal))
+    {}
+    RoutineTable const* CoreAppModelSnapshot::find_personal_routines(::winrt::guid const& user_id) const {
+        auto it = m_routines_personal->find(user_id);
+        return it != m_routines_personal->end() ? it->second.get() : nullptr;
+    }
 
     CoreAppModel::CoreAppModel() :
-        m_storage_path(L""), m_file_lock(), m_index_cfg_need_flush(false), m_routines_cfg_need_flush(false),
-        m_users(), m_routines_public(), m_routines_personal()
+        m_storage_mutex(), m_storage_path(L""), m_file_lock(),
+        m_index_cfg_need_flush(false), m_routines_cfg_need_flush(false),
+        m_users_mutex(), m_users(std::make_shared<UserDirectory>()), m_routines_personal(),
+        m_routines_public_mutex(), m_routines_public(make_public_routine_table(RoutineTable{})),
+        m_routines_public_epoch(0), m_epoch_counter(0)
     {}
     CoreAppModel::~CoreAppModel() {
         // Sync & disconnect storage if required
@@ -50,6 +1199,7 @@ namespace RoutineArranger::Core::implementation {
     }
     RoutineArrangerResultErrorKind CoreAppModel::try_connect_storage(const wchar_t* path, bool write_only) {
         // Success, or the original connection will remain unchanged
+        std::lock_guard storage_guard{ m_storage_mutex };
 
         if (*path == L'\0') {   // path == L""
             // Connect to nothing (disconnect existing storage)
@@ -58,9 +1208,12 @@ namespace RoutineArranger::Core::implementation {
             m_file_lock.close();
             if (!write_only) {
                 // Reading from nothing is the same as clearing data
-                m_users.clear();
-                m_routines_public.clear();
+                std::unique_lock users_guard{ m_users_mutex };
+                std::unique_lock routines_public_guard{ m_routines_public_mutex };
+                m_users = std::make_shared<UserDirectory>();
                 m_routines_personal.clear();
+                m_routines_public = make_public_routine_table(RoutineTable{});
+                m_routines_public_epoch = ++m_epoch_counter;
             }
             return RoutineArrangerResultErrorKind::Ok;
         }
@@ -161,9 +1314,9 @@ namespace RoutineArranger::Core::implementation {
 
         // Verify and extract json data
         // TODO: Silently merge routines that have the same start time (?)
-        std::vector<UserDesc> users;
-        std::vector<RoutineDesc> routines_public;
-        std::map<::winrt::guid, std::vector<RoutineDesc>> routines_personal;
+        UserDirectory users;
+        RoutineTable routines_public;
+        PersonalPartitions routines_personal;
 
         auto parse_index_jo_fn = [&] {
             try {
@@ -196,6 +1349,10 @@ namespace RoutineArranger::Core::implementation {
                     }
                     user.preferences.verify_identity_before_login =
                         i[L"preferences"][L"verify_identity_before_login"].get<bool>();
+                    if (users.contains(user.id) || users.contains_name(user.name)) {
+                        // Duplicate users cannot be addressed; keep the first one
+                        continue;
+                    }
                     users.push_back(std::move(user));
                 }
                 return true;
@@ -246,49 +1403,60 @@ namespace RoutineArranger::Core::implementation {
                                 throw std::exception("Repeat days and flags mismatch");
                             }
                             repeating.repeat_days_flags.resize(repeating.repeat_days_cycle);
-                            std::transform(
-                                flags.begin(), flags.end(),
-                                repeating.repeat_days_flags.begin(),
-                                [](json::JsonValue const& v) {
-                                    return static_cast<bool>(v.get_value<uint32_t>());
-                                }
-                            );
+                            for (size_t i = 0; i < flags.size(); i++) {
+                                repeating.repeat_days_flags.set(i, static_cast<bool>(flags[i].get_value<uint32_t>()));
+                            }
                             routine.template_options = std::move(repeating);
                         }
                     }
                     return routine;
                 };
 
-                for (auto& i : routines_jo[L"public"].get<json::JsonArray>()) {
+                // NOTE: Routines are parsed into a buffer and indexed all at
+                //       once, since inserting them one by one is quadratic
+                std::vector<RoutineDesc> buffer;
+                auto& routines_public_ja = routines_jo[L"public"].get<json::JsonArray>();
+                buffer.reserve(routines_public_ja.size());
+                for (auto& i : routines_public_ja) {
                     RoutineDesc routine = parse_routine_fn(i.get<json::JsonObject>());
                     if (std::holds_alternative<RoutineDescTemplate_Derived>(routine.template_options)) {
                         // Public derived routines are forbidden
                         return false;
                     }
-                    ordered_insert(routines_public, std::move(routine), pred_routine_desc_less_than);
+                    buffer.push_back(std::move(routine));
                 }
+                routines_public.assign(std::move(buffer));
                 for (auto& i : routines_jo[L"personal"].get<json::JsonObject>()) {
                     ::winrt::guid user_id = util::winrt::to_guid(i.first);
-                    if (std::find_if(
-                        users.begin(), users.end(),
-                        [&](UserDesc const& i) { return i.id == user_id; }
-                    ) == users.end())
-                    {
+                    if (!users.contains(user_id)) {
                         // User does not exist (may have been deleted); drop these
                         // routines without owners
                         continue;
                     }
 
-                    std::vector<RoutineDesc> routines;
-                    for (auto& item : i.second.get<json::JsonArray>()) {
-                        ordered_insert(
-                            routines,
-                            parse_routine_fn(item.get<json::JsonObject>()),
-                            pred_routine_desc_less_than
-                        );
+                    auto& routines_ja = i.second.get<json::JsonArray>();
+                    buffer.clear();
+                    buffer.reserve(routines_ja.size());
+                    std::vector<std::pair<::winrt::guid, PublicRoutineOverride>> overrides;
+                    for (auto& item : routines_ja) {
+                        RoutineDesc routine = parse_routine_fn(item.get<json::JsonObject>());
+                        // Copies of public routines are turned back into overrides
+                        auto slot = routines_public.find(routine.id);
+                        if (slot != UINT32_MAX && is_public_routine_override(routines_public[slot], routine)) {
+                            overrides.emplace_back(routine.id, PublicRoutineOverride{ routine.is_ended });
+                            continue;
+                        }
+                        buffer.push_back(std::move(routine));
+                    }
+                    auto routines = std::make_shared<RoutineTable>();
+                    routines->assign(std::move(buffer));
+                    for (auto const& [id, value] : overrides) {
+                        routines->set_public_override(id, value);
                     }
 
-                    routines_personal.emplace(user_id, std::move(routines));
+                    routines_personal.emplace(
+                        user_id, std::make_unique<PersonalPartition>(std::move(routines), ++m_epoch_counter)
+                    );
                 }
                 return true;
             }
@@ -306,18 +1474,49 @@ namespace RoutineArranger::Core::implementation {
         m_file_lock = std::move(file_lock);
         m_index_cfg_need_flush = index_cfg_need_flush;
         m_routines_cfg_need_flush = routines_cfg_need_flush;
-        m_users = std::move(users);
-        m_routines_public = std::move(routines_public);
+        // NOTE: The loaded partitions are not shared yet
+        for (auto const& i : routines_personal) {
+            auto& partition = *i.second;
+            partition.routines->for_each([&](RoutineDesc const& routine) {
+                if (ExpiryQueue::is_expiring(routine)) {
+                    partition.expiry_queue.schedule(routine);
+                }
+            });
+        }
+        std::unique_lock users_guard{ m_users_mutex };
+        std::unique_lock routines_public_guard{ m_routines_public_mutex };
+        m_users = std::make_shared<UserDirectory>(std::move(users));
         m_routines_personal = std::move(routines_personal);
+        m_routines_public = make_public_routine_table(std::move(routines_public));
+        m_routines_public_epoch = ++m_epoch_counter;
 
         return RoutineArrangerResultErrorKind::Ok;
     }
     bool CoreAppModel::try_flush_storage(void) {
+        std::lock_guard storage_guard{ m_storage_mutex };
         if (m_storage_path == L"") {
             // Syncing without storage should always succeed
             return true;
         }
 
+        // NOTE: Data is serialized from a snapshot, so that the model stays
+        //       available to other threads meanwhile
+        // NOTE: Dirty flags are cleared before pinning, so that concurrent
+        //       modifications missed by the snapshot will be flushed next time
+        bool index_cfg_need_flush = m_index_cfg_need_flush.exchange(false);
+        bool routines_cfg_need_flush = m_routines_cfg_need_flush.exchange(false);
+        // Marks data which has not been written as dirty again, on every exit
+        // path (including thrown integrity checks)
+        deferred([&] {
+            if (index_cfg_need_flush) {
+                m_index_cfg_need_flush = true;
+            }
+            if (routines_cfg_need_flush) {
+                m_routines_cfg_need_flush = true;
+            }
+        });
+        auto snapshot = this->pin_snapshot(nullptr);
+
         auto write_data_to_file_fn = [this](const wchar_t* cfg_name, json::JsonValue const& jv) {
             std::wstring cfg_path = m_storage_path + L"/" + cfg_name;
             if (util::fs::path_exists(cfg_path.c_str())) {
@@ -336,12 +1535,14 @@ namespace RoutineArranger::Core::implementation {
             return static_cast<bool>(f);
         };
 
-        if (m_index_cfg_need_flush) {
+        if (index_cfg_need_flush) {
             json::JsonObject jo;
             jo[L"version"] = 1;
             {
                 json::JsonArray ja_users;
-                for (auto const& i : m_users) {
+                // NOTE: Users are stored in creation order
+                for (auto const* user : snapshot->m_users->ordered_users()) {
+                    auto const& i = *user;
                     json::JsonObject jo_user;
                     jo_user[L"id"] = util::winrt::to_wstring(i.id);
                     jo_user[L"name"] = i.name;
@@ -376,9 +1577,9 @@ namespace RoutineArranger::Core::implementation {
             if (!write_data_to_file_fn(L"index.cfg", json::JsonValue{std::move(jo)})) {
                 return false;
             }
-            m_index_cfg_need_flush = false;
+            index_cfg_need_flush = false;
         }
-        if (m_routines_cfg_need_flush) {
+        if (routines_cfg_need_flush) {
             json::JsonObject jo;
             auto gen_routine_jo_fn = [](RoutineDesc const& data) {
                 json::JsonObject jo;
@@ -399,8 +1600,8 @@ namespace RoutineArranger::Core::implementation {
                     jo_repeating[L"repeat_cycles"] = p->repeat_cycles;
                     {
                         json::JsonArray ja_flags;
-                        for (auto const& i : p->repeat_days_flags) {
-                            ja_flags.push_back(static_cast<uint32_t>(i));
+                        for (size_t i = 0; i < p->repeat_days_flags.size(); i++) {
+                            ja_flags.push_back(static_cast<uint32_t>(p->repeat_days_flags[i]));
                         }
                         jo_repeating[L"repeat_days_flags"] = std::move(ja_flags);
                     }
@@ -418,375 +1619,1106 @@ namespace RoutineArranger::Core::implementation {
             };
             {
                 json::JsonArray ja_public;
-                for (auto const& i : m_routines_public) {
+                snapshot->m_routines_public->for_each([&](RoutineDesc const& i) {
                     if (i.is_ghost) {
                         throw std::exception("Integrity check for routine.is_ghost has failed");
                     }
                     ja_public.push_back(gen_routine_jo_fn(i));
+                });
+                jo[L"public"] = std::move(ja_public);
+            }
+            {
+                json::JsonObject jo_personal;
+                for (auto const& i : *snapshot->m_routines_personal) {
+                    json::JsonArray ja_routines;
+                    i.second->for_each([&](RoutineDesc const& i) {
+                        if (i.is_ghost) {
+                            return;
+                        }
+                        ja_routines.push_back(gen_routine_jo_fn(i));
+                    });
+                    // Overrides are stored as full routines; those of removed
+                    // public routines are dropped here
+                    for (auto const& [id, value] : i.second->public_overrides()) {
+                        auto slot = snapshot->m_routines_public->find(id);
+                        if (slot == UINT32_MAX) {
+                            continue;
+                        }
+                        RoutineDesc routine = (*snapshot->m_routines_public)[slot];
+                        routine.is_ended = value.is_ended;
+                        ja_routines.push_back(gen_routine_jo_fn(routine));
+                    }
+                    jo_personal[util::winrt::to_wstring(i.first)] = std::move(ja_routines);
+                }
+                jo[L"personal"] = std::move(jo_personal);
+            }
+            if (!write_data_to_file_fn(L"routines.cfg", json::JsonValue{std::move(jo)})) {
+                return false;
+            }
+            routines_cfg_need_flush = false;
+        }
+
+        return true;
+    }
+    const wchar_t* CoreAppModel::get_current_storage_path(void) {
+        return m_storage_path.c_str();
+    }
+    std::shared_ptr<CoreAppModelSnapshot> CoreAppModel::snapshot(void) {
+        return this->pin_snapshot(nullptr);
+    }
+    std::shared_ptr<CoreAppModelSnapshot> CoreAppModel::pin_snapshot(
+        ::winrt::guid const* user_ids,
+        size_t user_ids_count,
+        RoutineEpochs* epochs,
+        std::shared_ptr<RangeResultCache>* range_cache
+    ) {
+        // NOTE: Each partition is pinned at a consistent version; partitions
+        //       are locked one at a time, so that writers are barely blocked
+        std::shared_ptr<UserDirectory const> users;
+        auto routines_personal = std::make_shared<PersonalRoutineTables>();
+        {
+            std::shared_lock users_guard{ m_users_mutex };
+            users = m_users;
+            auto pin_partition_fn = [&](::winrt::guid const& id, PersonalPartition& partition) {
+                std::shared_lock guard{ partition.mutex };
+                routines_personal->emplace(id, partition.routines);
+                if (epochs != nullptr) {
+                    epochs->personal = partition.epoch;
+                }
+                if (range_cache != nullptr) {
+                    *range_cache = partition.range_cache;
+                }
+            };
+            if (epochs != nullptr) {
+                epochs->personal = 0;
+            }
+            if (range_cache != nullptr) {
+                range_cache->reset();
+            }
+            if (user_ids == nullptr) {
+                routines_personal->reserve(m_routines_personal.size());
+                for (auto const& i : m_routines_personal) {
+                    pin_partition_fn(i.first, *i.second);
+                }
+            }
+            else {
+                for (size_t i = 0; i < user_ids_count; i++) {
+                    auto it = m_routines_personal.find(user_ids[i]);
+                    if (it != m_routines_personal.end()) {
+                        pin_partition_fn(it->first, *it->second);
+                    }
+                }
+            }
+        }
+        std::shared_ptr<RoutineTable const> routines_public;
+        {
+            std::shared_lock guard{ m_routines_public_mutex };
+            routines_public = m_routines_public;
+            if (epochs != nullptr) {
+                epochs->public_routines = m_routines_public_epoch;
+            }
+        }
+        return std::make_shared<CoreAppModelSnapshot>(
+            std::move(users), std::move(routines_public), std::move(routines_personal)
+        );
+    }
+    bool CoreAppModel::create_user(const wchar_t* name, const wchar_t* nickname, bool is_admin) {
+        if (name == nullptr) {
+            name = L"";
+        }
+        if (nickname == nullptr) {
+            nickname = L"";
+        }
+        return this->create_users({ NewUserDesc{ name, nickname, is_admin } });
+    }
+    bool CoreAppModel::create_users(std::vector<NewUserDesc> const& users, std::vector<::winrt::guid>* user_ids) {
+        std::unique_lock users_guard{ m_users_mutex };
+        // Validate the whole batch before creating anything
+        std::unordered_set<std::wstring_view> batch_names;
+        batch_names.reserve(users.size());
+        for (auto const& i : users) {
+            if (i.name.empty() || i.nickname.empty()) {
+                return false;
+            }
+            for (auto ch : i.name) {
+                bool valid = ch < 0x80 && std::iswalnum(ch);
+                if (!valid) {
+                    return false;
+                }
+            }
+            // User names should not collide
+            if (m_users->contains_name(i.name) || !batch_names.insert(i.name).second) {
+                return false;
+            }
+        }
+        if (users.empty()) {
+            if (user_ids != nullptr) {
+                user_ids->clear();
+            }
+            return true;
+        }
+
+        if (user_ids != nullptr) {
+            user_ids->clear();
+            user_ids->reserve(users.size());
+        }
+        auto& model_users = detach_segment(m_users);
+        model_users.reserve(model_users.size() + users.size());
+        for (auto const& i : users) {
+            auto user_id = util::winrt::gen_random_guid();
+            UserDesc user;
+            user.id = user_id;
+            user.name = i.name;
+            user.nickname = i.nickname;
+            user.is_admin = i.is_admin;
+            user.last_routines_update_ts = 0;
+            user.preferences.day_view_prefer_timeline = true;
+            user.preferences.theme = ThemePreference::FollowSystem;
+            user.preferences.verify_identity_before_login = false;
+            model_users.push_back(std::move(user));
+            m_routines_personal.emplace(user_id, std::make_unique<PersonalPartition>(++m_epoch_counter));
+            if (user_ids != nullptr) {
+                user_ids->push_back(user_id);
+            }
+        }
+
+        m_index_cfg_need_flush = true;
+        m_routines_cfg_need_flush = true;
+
+        return true;
+    }
+    bool CoreAppModel::try_lookup_user(::winrt::guid user_id, UserDesc& desc) {
+        std::shared_lock users_guard{ m_users_mutex };
+        auto user = std::as_const(*m_users).find(user_id);
+        if (user == nullptr) {
+            return false;
+        }
+        desc = *user;
+        return true;
+    }
+    bool CoreAppModel::try_update_user(UserDesc const& desc) {
+        std::unique_lock users_guard{ m_users_mutex };
+        if (!m_users->contains(desc.id)) {
+            return false;
+        }
+        auto user = detach_segment(m_users).find(desc.id);
+        user->nickname = desc.nickname;
+        user->is_admin = desc.is_admin;
+        user->last_routines_update_ts = desc.last_routines_update_ts;
+        user->preferences = desc.preferences;
+
+        m_index_cfg_need_flush = true;
+        return true;
+    }
+    bool CoreAppModel::try_remove_user(::winrt::guid user_id) {
+        std::unique_lock users_guard{ m_users_mutex };
+        if (!m_users->contains(user_id)) {
+            return false;
+        }
+        detach_segment(m_users).erase(user_id);
+        // NOTE: Nobody can be holding the partition lock, as m_users_mutex
+        //       is always held (shared) beforehand; the expiry queue of the
+        //       user goes along with the partition
+        if (m_routines_personal.erase(user_id) > 0) {
+            m_routines_cfg_need_flush = true;
+        }
+        m_index_cfg_need_flush = true;
+        return true;
+    }
+    bool CoreAppModel::try_lookup_routine(::winrt::guid user_id, ::winrt::guid routine_id, RoutineDesc* routine) {
+        return this->pin_snapshot(&user_id)->try_lookup_routine(user_id, routine_id, routine);
+    }
+    bool CoreAppModel::try_decode_ghost_routine_id(
+        ::winrt::guid user_id,
+        ::winrt::guid routine_id,
+        ::winrt::guid& source_routine,
+        uint64_t& secs_since_epoch_start
+    ) {
+        return this->pin_snapshot(&user_id)->try_decode_ghost_routine_id(
+            user_id, routine_id, source_routine, secs_since_epoch_start
+        );
+    }
+    bool CoreAppModel::is_public_routine(::winrt::guid routine_id) {
+        std::shared_lock guard{ m_routines_public_mutex };
+        return m_routines_public->contains(routine_id);
+    }
+    bool CoreAppModel::try_get_routines_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint64_t secs_since_epoch_end,
+        std::vector<RoutineDesc>& routines
+    ) {
+        auto bucketed = this->get_bucketed_routines(user_id, secs_since_epoch_start, secs_since_epoch_end);
+        if (bucketed == nullptr) {
+            return false;
+        }
+        routines.clear();
+        for (auto const& i : *bucketed) {
+            if (i.start_secs_since_epoch < secs_since_epoch_end &&
+                routine_end_secs(i.start_secs_since_epoch, i.duration_secs) > secs_since_epoch_start)
+            {
+                routines.push_back(i);
+            }
+        }
+        return true;
+    }
+    bool CoreAppModel::try_visit_routines_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint64_t secs_since_epoch_end,
+        std::function<void(RoutineView const&)> const& fn
+    ) {
+        return this->pin_snapshot(&user_id)->try_visit_routines_from_user_view(
+            user_id, secs_since_epoch_start, secs_since_epoch_end, fn
+        );
+    }
+    bool CoreAppModel::try_get_upcoming_routines_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        size_t count,
+        std::vector<RoutineDesc>& routines
+    ) {
+        return this->pin_snapshot(&user_id)->try_get_upcoming_routines_from_user_view(
+            user_id, secs_since_epoch_start, count, routines
+        );
+    }
+    bool CoreAppModel::try_get_routine_day_summaries_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint32_t days_count,
+        std::vector<RoutineDaySummary>& summaries
+    ) {
+        if (days_count == 0) {
+            return this->pin_snapshot(&user_id)->try_get_routine_day_summaries_from_user_view(
+                user_id, secs_since_epoch_start, days_count, summaries
+            );
+        }
+        uint64_t secs_since_epoch_end = util::num::saturating_add(
+            secs_since_epoch_start,
+            util::num::saturating_mul(static_cast<uint64_t>(days_count), SECS_PER_DAY)
+        );
+        auto bucketed = this->get_bucketed_routines(user_id, secs_since_epoch_start, secs_since_epoch_end);
+        if (bucketed == nullptr) {
+            return false;
+        }
+        summaries.assign(days_count, RoutineDaySummary{ 0, 0, {} });
+        for (auto const& i : *bucketed) {
+            if (i.start_secs_since_epoch < secs_since_epoch_end &&
+                routine_end_secs(i.start_secs_since_epoch, i.duration_secs) > secs_since_epoch_start)
+            {
+                add_to_day_summaries(
+                    summaries, secs_since_epoch_start, secs_since_epoch_end,
+                    i.start_secs_since_epoch, i.duration_secs, i.is_ended, i.color
+                );
+            }
+        }
+        return true;
+    }
+    bool CoreAppModel::try_get_routine_conflicts_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint64_t secs_since_epoch_end,
+        std::vector<RoutineConflict>& conflicts
+    ) {
+        return this->pin_snapshot(&user_id)->try_get_routine_conflicts_from_user_view(
+            user_id, secs_since_epoch_start, secs_since_epoch_end, conflicts
+        );
+    }
+    bool CoreAppModel::try_get_conflicts_with_routine(
+        ::winrt::guid user_id,
+        RoutineDesc const& routine,
+        std::vector<RoutineDesc>& conflicts
+    ) {
+        return this->pin_snapshot(&user_id)->try_get_conflicts_with_routine(user_id, routine, conflicts);
+    }
+    bool CoreAppModel::try_find_free_slots_from_user_view(
+        ::winrt::guid user_id,
+        FreeSlotQuery const& query,
+        std::vector<std::pair<uint64_t, uint64_t>>& slots
+    ) {
+        return this->pin_snapshot(&user_id)->try_find_free_slots_from_user_view(user_id, query, slots);
+    }
+    bool CoreAppModel::try_find_common_free_slots(
+        std::vector<::winrt::guid> const& user_ids,
+        FreeSlotQuery const& query,
+        std::vector<std::pair<uint64_t, uint64_t>>& slots
+    ) {
+        return this->pin_snapshot(user_ids.data(), user_ids.size())->try_find_common_free_slots(user_ids, query, slots);
+    }
+    RangeCacheStats CoreAppModel::get_range_cache_stats(void) {
+        // NOTE: Counts of removed users (and previous storages) are dropped
+        //       along with their caches
+        RangeCacheStats stats{ 0, 0 };
+        std::shared_lock users_guard{ m_users_mutex };
+        for (auto const& i : m_routines_personal) {
+            stats.hits += i.second->range_cache->hits();
+            stats.misses += i.second->range_cache->misses();
+        }
+        return stats;
+    }
+    std::shared_ptr<std::vector<RoutineDesc> const> CoreAppModel::get_bucketed_routines(
+        ::winrt::guid const& user_id,
+        uint64_t start,
+        uint64_t end
+    ) {
+        if (start >= end) {
+            return nullptr;
+        }
+        RoutineEpochs epochs;
+        std::shared_ptr<RangeResultCache> range_cache;
+        auto snapshot = this->pin_snapshot(&user_id, &epochs, &range_cache);
+        if (range_cache == nullptr) {
+            return nullptr;
+        }
+        auto key = RangeResultCache::bucket_range(start, end);
+        if (auto cached = range_cache->find(key, epochs)) {
+            return cached;
+        }
+        auto result = std::make_shared<std::vector<RoutineDesc>>();
+        if (!snapshot->try_get_routines_from_user_view(user_id, key.start, key.end, *result)) {
+            return nullptr;
+        }
+        range_cache->insert(key, epochs, result);
+        return result;
+    }
+    bool CoreAppModel::can_override_public_routine(RoutineDesc const& routine) {
+        std::shared_lock guard{ m_routines_public_mutex };
+        auto slot = m_routines_public->find(routine.id);
+        return slot != UINT32_MAX && is_public_routine_override((*m_routines_public)[slot], routine);
+    }
+    bool CoreAppModel::try_update_routine_from_user_view(::winrt::guid user_id, RoutineDesc const& routine) {
+        std::shared_lock users_guard{ m_users_mutex };
+        auto it = m_routines_personal.find(user_id);
+        if (it == m_routines_personal.end()) {
+            return false;
+        }
+        std::unique_lock guard{ it->second->mutex };
+        auto& routines = detach_segment(it->second->routines);
+        // NOTE: Ghosts are not stored; updating a ghost simply makes it concrete
+        auto& expiry_queue = it->second->expiry_queue;
+        // NOTE: Neither version expiring (as usual) leaves nothing to update
+        //       in the expiry queue
+        bool was_expiring = false;
+        auto slot = routines.find(routine.id);
+        if (slot != UINT32_MAX) {
+            was_expiring = ExpiryQueue::is_expiring(routines[slot]);
+            routines.erase(slot);
+        }
+        routines.erase_public_override(routine.id);
+        if (this->can_override_public_routine(routine)) {
+            routines.set_public_override(routine.id, PublicRoutineOverride{ routine.is_ended });
+            if (was_expiring) {
+                expiry_queue.cancel(routine.id);
+            }
+        }
+        else {
+            RoutineDesc copied_routine = routine;
+            copied_routine.is_ghost = false;
+            if (was_expiring || ExpiryQueue::is_expiring(copied_routine)) {
+                expiry_queue.schedule(copied_routine);
+            }
+            routines.insert(std::move(copied_routine));
+        }
+        it->second->epoch = ++m_epoch_counter;
+        m_routines_cfg_need_flush = true;
+        return true;
+    }
+    bool CoreAppModel::try_remove_routine_from_user_view(::winrt::guid user_id, ::winrt::guid routine_id) {
+        std::shared_lock users_guard{ m_users_mutex };
+        auto it = m_routines_personal.find(user_id);
+        if (it == m_routines_personal.end()) {
+            return false;
+        }
+        std::unique_lock guard{ it->second->mutex };
+        bool is_overridden = it->second->routines->find_public_override(routine_id) != nullptr;
+        if (!is_overridden && !it->second->routines->contains(routine_id)) {
+            return false;
+        }
+        // TODO: Users are not allowed to delete a routine if it
+        //       comes directly from public ones
+        auto& routines = detach_segment(it->second->routines);
+        if (is_overridden) {
+            routines.erase_public_override(routine_id);
+        }
+        else {
+            auto slot = routines.find(routine_id);
+            if (ExpiryQueue::is_expiring(routines[slot])) {
+                it->second->expiry_queue.cancel(routine_id);
+            }
+            routines.erase(slot);
+        }
+        it->second->epoch = ++m_epoch_counter;
+        m_routines_cfg_need_flush = true;
+        return true;
+    }
+    void CoreAppModel::update_public_routine(RoutineDesc const& routine) {
+        std::unique_lock guard{ m_routines_public_mutex };
+        auto& routines_public = detach_segment(m_routines_public);
+        auto slot = routines_public.find(routine.id);
+        if (slot != UINT32_MAX) {
+            routines_public.erase(slot);
+        }
+        RoutineDesc copied_routine = routine;
+        normalize_public_routine(copied_routine);
+        routines_public.insert(std::move(copied_routine));
+        m_routines_public_epoch = ++m_epoch_counter;
+        m_routines_cfg_need_flush = true;
+    }
+    bool CoreAppModel::try_remove_public_routine(::winrt::guid routine_id) {
+        std::unique_lock guard{ m_routines_public_mutex };
+        if (!m_routines_public->contains(routine_id)) {
+            return false;
+        }
+        auto& routines_public = detach_segment(m_routines_public);
+        routines_public.erase(routines_public.find(routine_id));
+        m_routines_public_epoch = ++m_epoch_counter;
+        m_routines_cfg_need_flush = true;
+        return true;
+    }
+    bool CoreAppModel::try_apply_routine_batch(::winrt::guid user_id, RoutineBatch const& batch) {
+        bool is_public = user_id == ::winrt::guid{ GUID{} };
+        // NOTE: The lock guarding routines must be held
+        // NOTE: expiry_queue is nullptr for public routines
+        auto apply_fn = [&](std::shared_ptr<RoutineTable>& routines, uint64_t& epoch, ExpiryQueue* expiry_queue) {
+            // Validate the whole batch before modifying anything
+            std::unordered_set<::winrt::guid, GuidHash> batch_ids;
+            batch_ids.reserve(batch.updates.size() + batch.removals.size());
+            for (auto const& i : batch.updates) {
+                if (!batch_ids.insert(i.id).second) {
+                    return false;
+                }
+            }
+            for (auto const& i : batch.removals) {
+                bool exists = routines->contains(i) || routines->find_public_override(i) != nullptr;
+                if (!exists || !batch_ids.insert(i).second) {
+                    return false;
+                }
+            }
+            if (batch.empty()) {
+                return true;
+            }
+
+            std::vector<RoutineDesc> copied_routines;
+            std::vector<::winrt::guid> removed_ids = batch.removals;
+            std::vector<std::pair<::winrt::guid, PublicRoutineOverride>> overrides;
+            copied_routines.reserve(batch.updates.size());
+            for (auto const& i : batch.updates) {
+                if (!is_public && this->can_override_public_routine(i)) {
+                    // Drops the copy (if any) in favor of the override
+                    removed_ids.push_back(i.id);
+                    overrides.emplace_back(i.id, PublicRoutineOverride{ i.is_ended });
+                    continue;
+                }
+                auto& routine = copied_routines.emplace_back(i);
+                // NOTE: Ghosts are not stored; updating a ghost simply makes it concrete
+                routine.is_ghost = false;
+                if (is_public) {
+                    normalize_public_routine(routine);
+                }
+            }
+            if (expiry_queue != nullptr) {
+                // NOTE: Neither version expiring (as usual) leaves nothing to
+                //       update in the expiry queue
+                auto was_expiring_fn = [&](::winrt::guid const& id) {
+                    auto slot = routines->find(id);
+                    return slot != UINT32_MAX && ExpiryQueue::is_expiring((*routines)[slot]);
+                };
+                for (auto const& i : removed_ids) {
+                    if (was_expiring_fn(i)) {
+                        expiry_queue->cancel(i);
+                    }
                 }
-                jo[L"public"] = std::move(ja_public);
-            }
-            {
-                json::JsonObject jo_personal;
-                for (auto const& i : m_routines_personal) {
-                    json::JsonArray ja_routines;
-                    for (auto const& i : i.second) {
-                        if (i.is_ghost) {
-                            continue;
-                        }
-                        ja_routines.push_back(gen_routine_jo_fn(i));
+                for (auto const& i : copied_routines) {
+                    if (ExpiryQueue::is_expiring(i) || was_expiring_fn(i.id)) {
+                        expiry_queue->schedule(i);
                     }
-                    jo_personal[util::winrt::to_wstring(i.first)] = std::move(ja_routines);
                 }
-                jo[L"personal"] = std::move(jo_personal);
             }
-            if (!write_data_to_file_fn(L"routines.cfg", json::JsonValue{std::move(jo)})) {
-                return false;
+            auto& model_routines = detach_segment(routines);
+            model_routines.apply_batch(std::move(copied_routines), removed_ids);
+            if (!is_public) {
+                for (auto const& i : batch.updates) {
+                    model_routines.erase_public_override(i.id);
+                }
+                for (auto const& i : batch.removals) {
+                    model_routines.erase_public_override(i);
+                }
+                for (auto const& [id, value] : overrides) {
+                    model_routines.set_public_override(id, value);
+                }
             }
-            m_routines_cfg_need_flush = false;
-        }
-
-        return true;
-    }
-    const wchar_t* CoreAppModel::get_current_storage_path(void) {
-        return m_storage_path.c_str();
-    }
-    bool CoreAppModel::create_user(const wchar_t* name, const wchar_t* nickname, bool is_admin) {
-        if (name == nullptr) {
-            name = L"";
+            epoch = ++m_epoch_counter;
+            m_routines_cfg_need_flush = true;
+            return true;
+        };
+        if (is_public) {
+            std::unique_lock guard{ m_routines_public_mutex };
+            return apply_fn(m_routines_public, m_routines_public_epoch, nullptr);
         }
-        if (nickname == nullptr) {
-            nickname = L"";
+        std::shared_lock users_guard{ m_users_mutex };
+        auto it = m_routines_personal.find(user_id);
+        if (it == m_routines_personal.end()) {
+            return false;
         }
-        if (*name == L'\0' || *nickname == L'\0') {
+        std::unique_lock guard{ it->second->mutex };
+        return apply_fn(it->second->routines, it->second->epoch, &it->second->expiry_queue);
+    }
+
+    bool CoreAppModel::try_arrange_tasks_for_user(
+        ::winrt::guid user_id,
+        std::vector<FlexibleTaskDesc> const& tasks,
+        TaskArrangement& arrangement
+    ) {
+        std::shared_lock users_guard{ m_users_mutex };
+        auto it = m_routines_personal.find(user_id);
+        if (it == m_routines_personal.end()) {
             return false;
         }
-        for (auto ch : std::wstring_view{ name }) {
-            bool valid = ch < 0x80 && std::iswalnum(ch);
-            if (!valid) {
-                return false;
-            }
+        std::unique_lock guard{ it->second->mutex };
+        std::shared_ptr<RoutineTable const> routines_public;
+        {
+            std::shared_lock public_guard{ m_routines_public_mutex };
+            routines_public = m_routines_public;
         }
-        // User names should not collide
-        for (auto const& i : m_users) {
-            if (name == i.name) {
-                return false;
+
+        // Only free time between the earliest start and the latest deadline
+        // is of interest
+        uint64_t window_start = UINT64_MAX, window_end = 0;
+        for (auto const& i : tasks) {
+            if (i.earliest_start_secs_since_epoch < i.deadline_secs_since_epoch) {
+                window_start = std::min(window_start, i.earliest_start_secs_since_epoch);
+                window_end = std::max(window_end, i.deadline_secs_since_epoch);
             }
         }
+        std::vector<std::pair<uint64_t, uint64_t>> busy;
+        if (window_start < window_end) {
+            busy = collect_busy_periods(*it->second->routines, *routines_public, window_start, window_end);
+        }
+        auto starts = arrange_flexible_tasks(busy, window_start, window_end, tasks);
 
-        auto user_id = util::winrt::gen_random_guid();
-        UserDesc user;
-        user.id = user_id;
-        user.name = name;
-        user.nickname = nickname;
-        user.is_admin = is_admin;
-        user.last_routines_update_ts = 0;
-        user.preferences.day_view_prefer_timeline = true;
-        user.preferences.theme = ThemePreference::FollowSystem;
-        user.preferences.verify_identity_before_login = false;
-        m_users.push_back(std::move(user));
-
-        m_index_cfg_need_flush = true;
-
-        m_routines_personal.emplace(user_id, std::vector<RoutineDesc>{});
-        m_routines_cfg_need_flush = true;
-
-        return true;
-    }
-    bool CoreAppModel::try_lookup_user(::winrt::guid user_id, UserDesc& desc) {
-        for (auto const& i : m_users) {
-            if (user_id == i.id) {
-                desc = i;
-                return true;
+        TaskArrangement result;
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (starts[i] == UINT64_MAX) {
+                result.unplaced_tasks.push_back(i);
+                continue;
             }
+            auto const& task = tasks[i];
+            auto& routine = result.routines.emplace_back();
+            routine.id = util::winrt::gen_random_guid();
+            routine.start_secs_since_epoch = starts[i];
+            routine.duration_secs = task.duration_secs;
+            routine.is_ghost = false;
+            routine.name = task.name;
+            routine.description = task.description;
+            routine.color = task.color;
+            routine.end_trigger_kind = task.end_trigger_kind;
+            routine.is_ended = false;
+            routine.template_options = nullptr;
         }
-        return false;
-    }
-    bool CoreAppModel::try_update_user(UserDesc const& desc) {
-        for (auto& i : m_users) {
-            if (desc.id == i.id) {
-                i.nickname = desc.nickname;
-                i.is_admin = desc.is_admin;
-                i.last_routines_update_ts = desc.last_routines_update_ts;
-                i.preferences = desc.preferences;
-
-                m_index_cfg_need_flush = true;
-                return true;
+        if (!result.routines.empty()) {
+            auto& routines = detach_segment(it->second->routines);
+            routines.apply_batch(result.routines, {});
+            for (auto const& i : result.routines) {
+                if (ExpiryQueue::is_expiring(i)) {
+                    it->second->expiry_queue.schedule(i);
+                }
             }
+            it->second->epoch = ++m_epoch_counter;
+            m_routines_cfg_need_flush = true;
         }
-        return false;
+        arrangement = std::move(result);
+        return true;
     }
-    bool CoreAppModel::try_remove_user(::winrt::guid user_id) {
-        for (auto it = m_users.begin(); it != m_users.end(); it++) {
-            if (it->id == user_id) {
-                m_users.erase(it);
-                for (auto it2 = m_routines_personal.begin(); it2 != m_routines_personal.end(); it2++) {
-                    if (it2->first == user_id) {
-                        m_routines_personal.erase(it2);
-                        m_routines_cfg_need_flush = true;
-                        break;
-                    }
+
+    size_t CoreAppModel::expire_due_routines(uint64_t now_secs_since_epoch) {
+        size_t ended_count = 0;
+        std::shared_lock users_guard{ m_users_mutex };
+        for (auto const& i : m_routines_personal) {
+            auto& partition = *i.second;
+            {
+                // NOTE: Most users have nothing due; peeking does not block readers
+                std::shared_lock guard{ partition.mutex };
+                if (partition.expiry_queue.next_end() > now_secs_since_epoch) {
+                    continue;
                 }
-                m_index_cfg_need_flush = true;
-                return true;
             }
+            std::unique_lock guard{ partition.mutex };
+            auto due = partition.expiry_queue.take_due(now_secs_since_epoch);
+            auto const& routines = *partition.routines;
+            std::vector<RoutineDesc> ended_routines;
+            for (auto const& entry : due) {
+                auto slot = routines.find(entry.routine_id);
+                if (slot == UINT32_MAX) {
+                    continue;
+                }
+                auto const& routine = routines[slot];
+                // Skip routines modified after being scheduled
+                uint64_t end = routine_end_secs(routine.start_secs_since_epoch, routine.duration_secs);
+                if (!ExpiryQueue::is_expiring(routine) || end != entry.end_secs_since_epoch) {
+                    continue;
+                }
+                ended_routines.emplace_back(routine).is_ended = true;
+            }
+            if (ended_routines.empty()) {
+                continue;
+            }
+            ended_count += ended_routines.size();
+            detach_segment(partition.routines).apply_batch(std::move(ended_routines), {});
+            partition.epoch = ++m_epoch_counter;
         }
-        return false;
+        if (ended_count > 0) {
+            m_routines_cfg_need_flush = true;
+        }
+        return ended_count;
     }
-    bool CoreAppModel::try_lookup_routine(::winrt::guid user_id, ::winrt::guid routine_id, RoutineDesc* routine) {
+
+    bool CoreAppModelSnapshot::try_lookup_user(::winrt::guid user_id, UserDesc& desc) const {
+        auto user = m_users->find(user_id);
+        if (user == nullptr) {
+            return false;
+        }
+        desc = *user;
+        return true;
+    }
+    bool CoreAppModelSnapshot::try_lookup_routine(
+        ::winrt::guid user_id,
+        ::winrt::guid routine_id,
+        RoutineDesc* routine
+    ) const {
+        auto const& routines_public = *m_routines_public;
         // Search public routines
         if (user_id == ::winrt::guid{ GUID{} }) {
-            for (auto const& i : m_routines_public) {
-                if (i.id == routine_id) {
-                    if (routine != nullptr) {
-                        *routine = i;
-                    }
-                    return true;
-                }
+            auto slot = routines_public.find(routine_id);
+            if (slot == UINT32_MAX) {
+                return false;
             }
-            return false;
+            if (routine != nullptr) {
+                *routine = routines_public[slot];
+            }
+            return true;
         }
         // Search personal routines
-        for (auto const& i : m_routines_personal) {
-            if (i.first == user_id) {
-                for (auto const& j : i.second) {
-                    if (j.id == routine_id) {
-                        if (routine != nullptr) {
-                            *routine = j;
-                        }
-                        return true;
-                    }
+        auto routines = this->find_personal_routines(user_id);
+        if (routines == nullptr) {
+            return false;
+        }
+        auto slot = routines->find(routine_id);
+        if (slot != UINT32_MAX) {
+            if (routine != nullptr) {
+                *routine = (*routines)[slot];
+            }
+            return true;
+        }
+        // Public routines are visible to all users (as ghosts, unless overridden)
+        slot = routines_public.find(routine_id);
+        if (slot != UINT32_MAX) {
+            if (routine != nullptr) {
+                *routine = routines_public[slot];
+                if (auto value = routines->find_public_override(routine_id)) {
+                    routine->is_ended = value->is_ended;
+                }
+                else {
+                    routine->is_ghost = true;
                 }
-                break;
             }
+            return true;
         }
-        return false;
+        // Ghosts derived from repeating templates
+        uint64_t day_offset;
+        auto source = find_ghost_routine_source(*routines, routines_public, routine_id, day_offset);
+        if (source == nullptr) {
+            return false;
+        }
+        if (routine != nullptr) {
+            *routine = RoutineView{
+                source,
+                source->start_secs_since_epoch + day_offset * SECS_PER_DAY,
+                RoutineViewKind::DerivedGhost,
+                source->duration_secs,
+                source->color,
+                source->is_ended
+            }.to_routine_desc();
+        }
+        return true;
     }
-    bool CoreAppModel::try_get_routines_from_user_view(
+    bool CoreAppModelSnapshot::try_decode_ghost_routine_id(
+        ::winrt::guid user_id,
+        ::winrt::guid routine_id,
+        ::winrt::guid& source_routine,
+        uint64_t& secs_since_epoch_start
+    ) const {
+        auto routines = this->find_personal_routines(user_id);
+        if (routines == nullptr) {
+            return false;
+        }
+        uint64_t day_offset;
+        auto source = find_ghost_routine_source(*routines, *m_routines_public, routine_id, day_offset);
+        if (source == nullptr) {
+            return false;
+        }
+        source_routine = source->id;
+        secs_since_epoch_start = source->start_secs_since_epoch + day_offset * SECS_PER_DAY;
+        return true;
+    }
+    bool CoreAppModelSnapshot::is_public_routine(::winrt::guid routine_id) const {
+        return m_routines_public->contains(routine_id);
+    }
+    bool CoreAppModelSnapshot::try_get_routines_from_user_view(
         ::winrt::guid user_id,
         uint64_t secs_since_epoch_start,
         uint64_t secs_since_epoch_end,
         std::vector<RoutineDesc>& routines
-    ) {
-        // Generate ghosts from public routines (preserving id)
-        auto personal_it = m_routines_personal.begin();
-        for (; personal_it != m_routines_personal.end(); personal_it++) {
-            if (personal_it->first == user_id) {
-                break;
+    ) const {
+        std::vector<RoutineDesc> result;
+        if (!this->try_visit_routines_from_user_view(
+            user_id, secs_since_epoch_start, secs_since_epoch_end,
+            [&](RoutineView const& v) {
+                result.push_back(v.to_routine_desc());
             }
+        )) {
+            return false;
         }
+        routines = std::move(result);
+        return true;
+    }
+    bool CoreAppModelSnapshot::try_visit_routines_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint64_t secs_since_epoch_end,
+        std::function<void(RoutineView const&)> const& fn
+    ) const {
+        if (secs_since_epoch_start >= secs_since_epoch_end) {
+            return false;
+        }
+        auto routines = this->find_personal_routines(user_id);
         // TODO: Insert empty list if user-routines pair does not exist
-        if (personal_it == m_routines_personal.end()) {
+        if (routines == nullptr) {
             return false;
         }
-        auto& user_routines = personal_it->second;
-        for (auto const& i : m_routines_public) {
-            if (i.start_secs_since_epoch >= secs_since_epoch_end) {
-                break;
-            }
-            auto it = std::find_if(
-                user_routines.begin(), user_routines.end(),
-                [&](RoutineDesc const& v) {
-                    return v.id == i.id;
-                }
-            );
-            if (it != user_routines.end()) {
-                continue;
-            }
-            RoutineDesc copied_routine = i;
-            copied_routine.is_ghost = true;
-            ordered_insert(user_routines, copied_routine, pred_routine_desc_less_than);
-            //m_routines_cfg_need_flush = true;
+        // NOTE: Ghosts are generated on the fly and never stored; results are
+        //       cached by CoreAppModel (see RangeResultCache)
+        expand_user_routines(
+            *routines, *m_routines_public,
+            secs_since_epoch_start, secs_since_epoch_end,
+            fn
+        );
+        return true;
+    }
+    bool CoreAppModelSnapshot::try_get_upcoming_routines_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        size_t count,
+        std::vector<RoutineDesc>& routines
+    ) const {
+        auto user_routines = this->find_personal_routines(user_id);
+        if (user_routines == nullptr) {
+            return false;
         }
-        // Generate ghosts from personal routines (regardless of is_ghost)
-        std::vector<RoutineDesc> user_repeating_routines;
-        for (auto const& i : user_routines) {
-            if (i.start_secs_since_epoch >= secs_since_epoch_end) {
-                break;
-            }
-            if (std::holds_alternative<RoutineDescTemplate_Repeating>(i.template_options)) {
-                user_repeating_routines.push_back(i);
+        routines.clear();
+        if (count == 0) {
+            return true;
+        }
+        expand_user_routines(
+            *user_routines, *m_routines_public,
+            secs_since_epoch_start, std::numeric_limits<uint64_t>::max(),
+            [&](RoutineView const& v) {
+                routines.push_back(v.to_routine_desc());
+                return routines.size() < count;
             }
+        );
+        return true;
+    }
+    bool CoreAppModelSnapshot::try_get_routine_day_summaries_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint32_t days_count,
+        std::vector<RoutineDaySummary>& summaries
+    ) const {
+        auto routines = this->find_personal_routines(user_id);
+        if (routines == nullptr) {
+            return false;
+        }
+        summaries.assign(days_count, RoutineDaySummary{ 0, 0, {} });
+        if (days_count == 0) {
+            return true;
         }
-        for (auto const& i : user_repeating_routines) {
-            auto& repeating = std::get<RoutineDescTemplate_Repeating>(i.template_options);
-            auto repeat_cycles = static_cast<size_t>(repeating.repeat_cycles);
-            if (repeat_cycles == 0) {
-                repeat_cycles = std::numeric_limits<size_t>::max();
+        uint64_t secs_since_epoch_end = util::num::saturating_add(
+            secs_since_epoch_start,
+            util::num::saturating_mul(static_cast<uint64_t>(days_count), SECS_PER_DAY)
+        );
+        expand_user_routines(
+            *routines, *m_routines_public,
+            secs_since_epoch_start, secs_since_epoch_end,
+            [&](RoutineView const& v) {
+                add_to_day_summaries(
+                    summaries, secs_since_epoch_start, secs_since_epoch_end,
+                    v.start_secs_since_epoch, v.duration_secs, v.is_ended, v.color
+                );
             }
-            for (size_t times = 0; times < repeat_cycles; times++) {
-                uint64_t start_secs_offset = times * SECS_PER_DAY * repeating.repeat_days_cycle;
-                if (i.start_secs_since_epoch + start_secs_offset >= secs_since_epoch_end) {
-                    break;
+        );
+        return true;
+    }
+    bool CoreAppModelSnapshot::try_get_routine_conflicts_from_user_view(
+        ::winrt::guid user_id,
+        uint64_t secs_since_epoch_start,
+        uint64_t secs_since_epoch_end,
+        std::vector<RoutineConflict>& conflicts
+    ) const {
+        if (secs_since_epoch_start >= secs_since_epoch_end) {
+            return false;
+        }
+        auto routines = this->find_personal_routines(user_id);
+        if (routines == nullptr) {
+            return false;
+        }
+        // Sweep over routines in ascending order of start time; a routine
+        // starting before the furthest end seen so far joins the current group
+        std::vector<RoutineConflict> result;
+        std::vector<RoutineView> group;
+        uint64_t group_end = 0;
+        auto flush_group_fn = [&] {
+            if (group.size() >= 2) {
+                auto& conflict = result.emplace_back();
+                conflict.start_secs_since_epoch = group.front().start_secs_since_epoch;
+                conflict.end_secs_since_epoch = group_end;
+                conflict.routines.reserve(group.size());
+                for (auto const& i : group) {
+                    conflict.routines.push_back(i.to_routine_desc());
                 }
-                RoutineDesc copied_routine = i;
-                copied_routine.is_ghost = true;
-                copied_routine.template_options = RoutineDescTemplate_Derived{ i.id };
-                // TODO: Cache last updated time when routines remain unchanged
-                //       to avoid redundant calculations and improve performance
-                // Avoid collision with first day if flag is set
-                for (size_t idx = times == 0 ? 1 : 0; idx < repeating.repeat_days_cycle; idx++) {
-                    if (!repeating.repeat_days_flags[idx]) {
-                        continue;
-                    }
-                    copied_routine.start_secs_since_epoch =
-                        i.start_secs_since_epoch + start_secs_offset + idx * SECS_PER_DAY;
-                    copied_routine.id = util::winrt::gen_random_guid();
-                    //copied_routine.template_kind = RoutineTemplateKind::Derived;
-                    /* NOTE: Unoptimized version
-                    auto it = std::find_if(
-                        user_routines.begin(), user_routines.end(),
-                        [&](RoutineDesc const& v) {
-                            return pred_derived_routines_in_same_day(v, copied_routine);
-                        }
-                    );
-                    if (it != user_routines.end()) {
-                        continue;
-                    }
-                    */
-                    auto try_find_derived_routine_in_same_day = [&] {
-                        auto find_start_secs =
-                            (copied_routine.start_secs_since_epoch / SECS_PER_DAY) * SECS_PER_DAY;
-                        auto find_end_secs = find_start_secs + SECS_PER_DAY;
-                        auto it = std::lower_bound(
-                            user_routines.begin(), user_routines.end(),
-                            find_start_secs,
-                            [](RoutineDesc const& rd, auto const& v) {
-                                return rd.start_secs_since_epoch < v;
-                            }
-                        );
-                        auto it_end = user_routines.end();
-                        for (; it != it_end; it++) {
-                            if (it->start_secs_since_epoch >= find_end_secs) {
-                                break;
-                            }
-                            auto derived = std::get_if<RoutineDescTemplate_Derived>(&it->template_options);
-                            if (!derived) {
-                                continue;
-                            }
-                            if (derived->source_routine != i.id) {
-                                continue;
-                            }
-                            return true;
-                        }
-                        return false;
-                    };
-                    if (try_find_derived_routine_in_same_day()) {
-                        continue;
-                    }
-                    ordered_insert(user_routines, copied_routine, pred_routine_desc_less_than);
-                    //m_routines_cfg_need_flush = true;
+            }
+            group.clear();
+        };
+        // NOTE: Views stay valid as long as the snapshot does
+        expand_user_routines(
+            *routines, *m_routines_public,
+            secs_since_epoch_start, secs_since_epoch_end,
+            [&](RoutineView const& v) {
+                uint64_t end = routine_end_secs(v.start_secs_since_epoch, v.duration_secs);
+                if (v.start_secs_since_epoch >= group_end) {
+                    flush_group_fn();
                 }
+                group.push_back(v);
+                group_end = group.size() == 1 ? end : std::max(group_end, end);
             }
+        );
+        flush_group_fn();
+        conflicts = std::move(result);
+        return true;
+    }
+    bool CoreAppModelSnapshot::try_get_conflicts_with_routine(
+        ::winrt::guid user_id,
+        RoutineDesc const& routine,
+        std::vector<RoutineDesc>& conflicts
+    ) const {
+        auto routines = this->find_personal_routines(user_id);
+        if (routines == nullptr) {
+            return false;
         }
-        // Collect all routines in ascending order and return
-        routines.clear();
-        auto user_routines_it = std::lower_bound(
-            user_routines.begin(), user_routines.end(),
-            secs_since_epoch_start,
-            [](RoutineDesc const& rd, uint64_t const& start_secs) {
-                return rd.start_secs_since_epoch < start_secs;
+        std::vector<RoutineDesc> result;
+        // NOTE: Overlap queries already match [start, end) exactly
+        expand_user_routines(
+            *routines, *m_routines_public,
+            routine.start_secs_since_epoch,
+            routine_end_secs(routine.start_secs_since_epoch, routine.duration_secs),
+            [&](RoutineView const& v) {
+                // Skip the stored version of the routine itself (which may be
+                // a single ghost being edited), including ghosts derived from
+                // it if it is a template being edited
+                bool is_self = v.id() == routine.id ||
+                    (v.kind == RoutineViewKind::DerivedGhost && v.source->id == routine.id);
+                if (!is_self) {
+                    result.push_back(v.to_routine_desc());
+                }
             }
         );
-        for (; user_routines_it != user_routines.end(); user_routines_it++) {
-            if (user_routines_it->start_secs_since_epoch >= secs_since_epoch_end) {
-                break;
-            }
-            routines.push_back(*user_routines_it);
-        }
+        conflicts = std::move(result);
         return true;
     }
-    bool CoreAppModel::try_update_routine_from_user_view(::winrt::guid user_id, RoutineDesc const& routine) {
-        for (auto it = m_routines_personal.begin(); it != m_routines_personal.end(); it++) {
-            if (it->first == user_id) {
-                auto it2 = std::find_if(
-                    it->second.begin(), it->second.end(),
-                    [&](RoutineDesc const& a) {
-                        return a.id == routine.id;
-                    }
-                );
-                if (it2 != it->second.end()) {
-                    it->second.erase(it2);
-                    // TODO: Remove all *related* ghost routines if necessary
-                    it->second.erase(
-                        std::remove_if(it->second.begin(), it->second.end(), pred_routine_is_ghost),
-                        it->second.end()
-                    );
+    bool CoreAppModelSnapshot::try_find_free_slots_from_user_view(
+        ::winrt::guid user_id,
+        FreeSlotQuery const& query,
+        std::vector<std::pair<uint64_t, uint64_t>>& slots
+    ) const {
+        if (query.secs_since_epoch_start >= query.secs_since_epoch_end) {
+            return false;
+        }
+        auto routines = this->find_personal_routines(user_id);
+        if (routines == nullptr) {
+            return false;
+        }
+        // Sweep over busy periods in ascending order of start time, merging
+        // them on the fly; gaps in between are free
+        FreeSlotCollector collector{ query };
+        uint64_t free_start = query.secs_since_epoch_start;
+        expand_user_routines(
+            *routines, *m_routines_public,
+            query.secs_since_epoch_start, query.secs_since_epoch_end,
+            [&](RoutineView const& v) {
+                if (v.start_secs_since_epoch > free_start) {
+                    collector.add_free(free_start, v.start_secs_since_epoch);
                 }
-                RoutineDesc copied_routine = routine;
-                copied_routine.is_ghost = false;
-                ordered_insert(it->second, copied_routine, pred_routine_desc_less_than);
-                m_routines_cfg_need_flush = true;
-                return true;
+                free_start = std::max(free_start, routine_end_secs(v.start_secs_since_epoch, v.duration_secs));
+                return !collector.full();
             }
+        );
+        if (free_start < query.secs_since_epoch_end) {
+            collector.add_free(free_start, query.secs_since_epoch_end);
         }
-        return false;
+        slots = collector.take();
+        return true;
     }
-    bool CoreAppModel::try_remove_routine_from_user_view(::winrt::guid user_id, ::winrt::guid routine_id) {
-        for (auto it = m_routines_personal.begin(); it != m_routines_personal.end(); it++) {
-            if (it->first == user_id) {
-                for (auto it2 = it->second.begin(); it2 != it->second.end(); it2++) {
-                    if (it2->id == routine_id) {
-                        // TODO: Users are not allowed to delete a routine if it
-                        //       comes directly from public ones
-                        it->second.erase(it2);
-                        // TODO: Remove all *related* ghost routines if necessary
-                        it->second.erase(
-                            std::remove_if(it->second.begin(), it->second.end(), pred_routine_is_ghost),
-                            it->second.end()
-                        );
-                        m_routines_cfg_need_flush = true;
-                        return true;
-                    }
-                }
-                break;
+    bool CoreAppModelSnapshot::try_find_common_free_slots(
+        std::vector<::winrt::guid> const& user_ids,
+        FreeSlotQuery const& query,
+        std::vector<std::pair<uint64_t, uint64_t>>& slots
+    ) const {
+        if (query.secs_since_epoch_start >= query.secs_since_epoch_end) {
+            return false;
+        }
+        std::vector<RoutineTable const*> tables;
+        tables.reserve(user_ids.size());
+        size_t routines_count = 0;
+        for (auto const& id : user_ids) {
+            auto routines = this->find_personal_routines(id);
+            if (routines == nullptr) {
+                return false;
             }
+            tables.push_back(routines);
+            routines_count += routines->size();
         }
-        return false;
+        // Busy periods of each user are independent of each other; the
+        // snapshot is immutable, so they are collected in parallel
+        std::vector<std::vector<std::pair<uint64_t, uint64_t>>> busy(tables.size());
+        parallel_for_each_index(tables.size(), routines_count, [&](size_t i) {
+            busy[i] = collect_busy_periods(
+                *tables[i], *m_routines_public,
+                query.secs_since_epoch_start, query.secs_since_epoch_end
+            );
+        });
+        // K-way merge of the (sorted and disjoint) busy periods of all users;
+        // gaps in the merged sequence are free for everyone
+        using HeapEntry = std::pair<uint64_t, size_t>;     // (start, user index)
+        std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap;
+        std::vector<size_t> positions(busy.size(), 0);
+        for (size_t i = 0; i < busy.size(); i++) {
+            if (!busy[i].empty()) {
+                heap.emplace(busy[i].front().first, i);
+            }
+        }
+        FreeSlotCollector collector{ query };
+        uint64_t free_start = query.secs_since_epoch_start;
+        while (!heap.empty() && !collector.full()) {
+            size_t idx = heap.top().second;
+            heap.pop();
+            auto const& period = busy[idx][positions[idx]];
+            if (period.first > free_start) {
+                collector.add_free(free_start, period.first);
+            }
+            free_start = std::max(free_start, period.second);
+            if (++positions[idx] < busy[idx].size()) {
+                heap.emplace(busy[idx][positions[idx]].first, idx);
+            }
+        }
+        if (free_start < query.secs_since_epoch_end) {
+            collector.add_free(free_start, query.secs_since_epoch_end);
+        }
+        slots = collector.take();
+        return true;
     }
-    void CoreAppModel::update_public_routine(RoutineDesc const& routine) {
-        auto it = std::find_if(
-            m_routines_public.begin(), m_routines_public.end(),
-            [&](RoutineDesc const& i) {
-                return i.id == routine.id;
+}
+
+namespace RoutineArranger::Core {
+    ::winrt::guid RoutineView::id() const {
+        if (kind == RoutineViewKind::DerivedGhost) {
+            return implementation::make_ghost_routine_id(
+                source->id,
+                (start_secs_since_epoch - source->start_secs_since_epoch) / SECS_PER_DAY
+            );
+        }
+        return source->id;
+    }
+    RoutineDesc RoutineView::to_routine_desc() const {
+        RoutineDesc routine = *source;
+        // NOTE: May come from a per-user override of a public routine
+        routine.is_ended = is_ended;
+        switch (kind) {
+        case RoutineViewKind::Concrete:
+            break;
+        case RoutineViewKind::PublicGhost:
+            routine.is_ghost = true;
+            break;
+        case RoutineViewKind::DerivedGhost:
+            routine.id = this->id();
+            routine.start_secs_since_epoch = start_secs_since_epoch;
+            routine.is_ghost = true;
+            routine.template_options = RoutineDescTemplate_Derived{ source->id };
+            break;
+        }
+        return routine;
+    }
+
+    RepeatDaysFlags::RepeatDaysFlags(std::initializer_list<bool> flags) : RepeatDaysFlags() {
+        this->resize(flags.size());
+        size_t pos = 0;
+        for (bool value : flags) {
+            this->set(pos++, value);
+        }
+    }
+    void RepeatDaysFlags::set(size_t pos, bool value) {
+        uint64_t mask = uint64_t{ 1 } << (pos % 64);
+        if (value) {
+            this->words()[pos / 64] |= mask;
+        }
+        else {
+            this->words()[pos / 64] &= ~mask;
+        }
+    }
+    void RepeatDaysFlags::resize(size_t new_size, bool value) {
+        size_t old_size = m_size;
+        size_t new_words_count = (new_size + 63) / 64;
+        // Move between inline and spilled storage if required
+        if (new_size > INLINE_BITS) {
+            if (old_size <= INLINE_BITS) {
+                m_spill.assign(std::begin(m_inline), std::end(m_inline));
+                std::fill(std::begin(m_inline), std::end(m_inline), 0);
             }
-        );
-        if (it != m_routines_public.end()) {
-            m_routines_public.erase(it);
-            // TODO: Remove all *related* ghost routines if necessary
-            for (auto& i : m_routines_personal) {
-                i.second.erase(
-                    std::remove_if(i.second.begin(), i.second.end(), pred_routine_is_ghost),
-                    i.second.end()
-                );
+            m_spill.resize(new_words_count, 0);
+        }
+        else if (old_size > INLINE_BITS) {
+            std::copy(m_spill.begin(), m_spill.begin() + INLINE_WORDS, std::begin(m_inline));
+            m_spill = std::vector<uint64_t>();
+        }
+        m_size = new_size;
+        auto words = this->words();
+        if (new_size < old_size) {
+            // Keep bits at or after m_size cleared
+            if (new_size % 64 != 0) {
+                words[new_size / 64] &= (uint64_t{ 1 } << (new_size % 64)) - 1;
+            }
+            if (new_size <= INLINE_BITS) {
+                std::fill(m_inline + new_words_count, std::end(m_inline), 0);
             }
         }
-        RoutineDesc copied_routine = routine;
-        copied_routine.is_ghost = false;
-        // Public routine cannot be ended ones
-        copied_routine.is_ended = false;
-        // Public routine cannot be derived ones
-        if (std::holds_alternative<RoutineDescTemplate_Derived>(copied_routine.template_options)) {
-            copied_routine.template_options = nullptr;
+        else if (value) {
+            for (size_t i = old_size; i < new_size; i++) {
+                this->set(i, true);
+            }
         }
-        ordered_insert(m_routines_public, copied_routine, pred_routine_desc_less_than);
-        m_routines_cfg_need_flush = true;
     }
-    bool CoreAppModel::try_remove_public_routine(::winrt::guid routine_id) {
-        for (auto it = m_routines_public.begin(); it != m_routines_public.end(); it++) {
-            if (it->id == routine_id) {
-                m_routines_public.erase(it);
-                // TODO: Remove all *related* ghost routines if necessary
-                for (auto& i : m_routines_personal) {
-                    i.second.erase(
-                        std::remove_if(i.second.begin(), i.second.end(), pred_routine_is_ghost),
-                        i.second.end()
-                    );
-                }
-                m_routines_cfg_need_flush = true;
-                return true;
+    size_t RepeatDaysFlags::find_next(size_t pos) const {
+        if (pos >= m_size) {
+            return m_size;
+        }
+        auto words = this->words();
+        size_t words_count = (m_size + 63) / 64;
+        size_t idx = pos / 64;
+        uint64_t word = words[idx] & (~uint64_t{ 0 } << (pos % 64));
+        while (word == 0) {
+            if (++idx >= words_count) {
+                return m_size;
             }
+            word = words[idx];
         }
-        return false;
+        return idx * 64 + util::num::count_trailing_zeros(word);
     }
 }
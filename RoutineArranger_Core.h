@@ -2,7 +2,17 @@
 
 #include "RoutineArranger.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 #include "json.h"
 
 namespace RoutineArranger {
@@ -15,10 +25,16 @@ namespace RoutineArranger {
 
         // Model: Acts as basic data objects (for example, searching is not handled)
         internal_export_arc_type(CoreAppModel);
+        // Immutable version of the model, which can be read on any thread
+        internal_export_arc_type(CoreAppModelSnapshot);
 
 #undef internal_export_arc_type
 #undef internal_define_arc_type
 
+        // NOTE: Days are always 24 hours long; local days are found with a
+        //       time zone offset instead
+        constexpr uint64_t SECS_PER_DAY = 60 * 60 * 24;
+
         enum class RoutineArrangerResultErrorKind {
             Ok = 0,
             StorageNotAccessible = -1,
@@ -46,6 +62,12 @@ namespace RoutineArranger {
             uint64_t last_routines_update_ts;
             UserPreferences preferences;
         };
+        // NOTE: Used for creating users in batches
+        struct NewUserDesc {
+            std::wstring name;
+            std::wstring nickname;
+            bool is_admin;
+        };
         // Bitmask
         enum RoutineEndTriggerKind {
             Manual = 0x0,
@@ -56,10 +78,39 @@ namespace RoutineArranger {
             Repeating,
             Derived,    // Derived from a template
         };
+        // Bitset of repeat days
+        // NOTE: Cycles of up to INLINE_BITS days are stored inline; longer
+        //       ones spill over to the heap
+        struct RepeatDaysFlags {
+            static constexpr size_t INLINE_WORDS = 2;
+            static constexpr size_t INLINE_BITS = INLINE_WORDS * 64;
+
+            RepeatDaysFlags() : m_size(0), m_inline{}, m_spill() {}
+            RepeatDaysFlags(std::initializer_list<bool> flags);
+
+            size_t size(void) const { return m_size; }
+            bool empty(void) const { return m_size == 0; }
+            bool operator[](size_t pos) const {
+                return (this->words()[pos / 64] >> (pos % 64)) & 1;
+            }
+            void set(size_t pos, bool value);
+            // NOTE: Flags appended while growing are set to value
+            void resize(size_t new_size, bool value = false);
+            // NOTE: Returns size() if no flag at or after pos is set
+            size_t find_next(size_t pos) const;
+        private:
+            uint64_t const* words(void) const { return m_size <= INLINE_BITS ? m_inline : m_spill.data(); }
+            uint64_t* words(void) { return m_size <= INLINE_BITS ? m_inline : m_spill.data(); }
+
+            // NOTE: Bits at or after m_size are always cleared
+            size_t m_size;
+            uint64_t m_inline[INLINE_WORDS];
+            std::vector<uint64_t> m_spill;
+        };
         struct RoutineDescTemplate_Repeating {
             uint32_t repeat_days_cycle;
             uint32_t repeat_cycles;
-            std::vector<bool> repeat_days_flags;
+            RepeatDaysFlags repeat_days_flags;
         };
         struct RoutineDescTemplate_Derived {
             ::winrt::guid source_routine;
@@ -86,6 +137,638 @@ namespace RoutineArranger {
                 RoutineDescTemplate_Derived
             > template_options;
         };
+        enum class RoutineViewKind {
+            Concrete,       // Stored in personal routines
+            PublicGhost,    // Public routine which has not been used by the user
+            DerivedGhost,   // Generated from a repeating template
+        };
+        // Lightweight read-only handle to a routine as seen by a user
+        // NOTE: Refers to model storage; see the query which produced it
+        //       for how long it stays valid
+        struct RoutineView {
+            // NOTE: For derived ghosts, this is the repeating template, whose
+            //       fields other than id, start and template options apply
+            // NOTE: Prefer the hot fields below, which are read from dense
+            //       columns, to touching the payload through source
+            RoutineDesc const* source;
+            uint64_t start_secs_since_epoch;
+            RoutineViewKind kind;
+            uint64_t duration_secs;
+            uint32_t color;
+            bool is_ended;
+
+            ::winrt::guid id() const;
+            bool is_ghost() const { return kind != RoutineViewKind::Concrete; }
+            RoutineDesc to_routine_desc() const;
+        };
+        // Aggregates of the routines overlapping a single day
+        struct RoutineDaySummary {
+            uint32_t total_count;
+            uint32_t ended_count;
+            // NOTE: In ascending order of start time
+            std::vector<uint32_t> colors;
+        };
+        // Routines overlapping each other (directly or through one another),
+        // as seen by a user
+        struct RoutineConflict {
+            // NOTE: [start, end) covered by the routines
+            uint64_t start_secs_since_epoch;
+            uint64_t end_secs_since_epoch;
+            // NOTE: At least two, in ascending order of start time
+            std::vector<RoutineDesc> routines;
+        };
+        // Parameters of CoreAppModel::try_find_free_slots_from_user_view and
+        // CoreAppModel::try_find_common_free_slots
+        struct FreeSlotQuery {
+            uint64_t secs_since_epoch_start;
+            uint64_t secs_since_epoch_end;
+            // NOTE: Shorter free periods are not reported
+            uint64_t min_duration_secs;
+            // NOTE: Daily working hours as [begin, end) seconds since the start
+            //       of a (local) day; the whole day is available if begin >= end
+            uint32_t day_secs_begin;
+            uint32_t day_secs_end;
+            // NOTE: Local time = secs since epoch + tz_offset_secs
+            int64_t tz_offset_secs;
+            // NOTE: Stops after finding this many slots; 0 means no limit
+            uint32_t max_count;
+        };
+        // Counters of the range result cache, for tuning its capacity
+        struct RangeCacheStats {
+            uint64_t hits;
+            uint64_t misses;
+        };
+        // A set of routine modifications to be applied as a whole
+        // NOTE: Each id may appear at most once across the whole batch
+        struct RoutineBatch {
+            // Routines to be inserted, or updated if the id already exists
+            std::vector<RoutineDesc> updates;
+            // NOTE: Every routine to be removed must exist
+            std::vector<::winrt::guid> removals;
+
+            bool empty(void) const { return updates.empty() && removals.empty(); }
+        };
+        // A task to be placed into free time by CoreAppModel::try_arrange_tasks_for_user
+        struct FlexibleTaskDesc {
+            uint64_t duration_secs;
+            // NOTE: The task must be placed within [earliest_start, deadline)
+            uint64_t earliest_start_secs_since_epoch;
+            uint64_t deadline_secs_since_epoch;
+            std::wstring name;
+            std::wstring description;
+            uint32_t color;
+            RoutineEndTriggerKind end_trigger_kind;
+        };
+        struct TaskArrangement {
+            // NOTE: Concrete routines in the order of their tasks; tasks which
+            //       could not be placed are skipped
+            std::vector<RoutineDesc> routines;
+            // Indices of tasks which could not be placed, in ascending order
+            std::vector<size_t> unplaced_tasks;
+        };
+
+        namespace implementation {
+            inline uint64_t mix_u64(uint64_t v) noexcept {
+                // Source: splitmix64 finalizer
+                v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9;
+                v = (v ^ (v >> 27)) * 0x94d049bb133111eb;
+                return v ^ (v >> 31);
+            }
+            inline uint64_t hash_guid(::winrt::guid const& value) noexcept {
+                uint64_t parts[2];
+                static_assert(sizeof(parts) == sizeof(value), "Unexpected guid layout");
+                std::memcpy(parts, &value, sizeof(parts));
+                return mix_u64(parts[0] ^ mix_u64(parts[1]));
+            }
+            struct GuidHash {
+                size_t operator()(::winrt::guid const& value) const noexcept {
+                    return static_cast<size_t>(hash_guid(value));
+                }
+            };
+            // NOTE: Identifies a repeating template within ghost ids (60 bits)
+            inline uint64_t routine_template_key(::winrt::guid const& id) noexcept {
+                return hash_guid(id) & 0x0fffffffffffffff;
+            }
+
+            // Users indexed by id and by name
+            // NOTE: Removal swaps the last user into the freed position, so that
+            //       it costs O(1); creation order is kept by sequence numbers
+            struct UserDirectory {
+                UserDirectory() : m_users(), m_sequences(), m_next_sequence(0), m_id_index(), m_name_index() {}
+
+                // NOTE: In creation order unless users have been removed
+                std::vector<UserDesc> const& users(void) const { return m_users; }
+                // Users in creation order, in O(n log n)
+                std::vector<UserDesc const*> ordered_users(void) const;
+                size_t size(void) const { return m_users.size(); }
+                // NOTE: Returns nullptr if not found
+                UserDesc* find(::winrt::guid const& id);
+                UserDesc const* find(::winrt::guid const& id) const;
+                bool contains(::winrt::guid const& id) const { return m_id_index.count(id) > 0; }
+                bool contains_name(std::wstring const& name) const { return m_name_index.count(name) > 0; }
+                void reserve(size_t new_cap);
+                // NOTE: Caller must ensure that both id and name are unique
+                void push_back(UserDesc user);
+                bool erase(::winrt::guid const& id);
+                void clear(void);
+            private:
+                std::vector<UserDesc> m_users;
+                // NOTE: m_sequences[i] orders m_users[i] by creation
+                std::vector<uint64_t> m_sequences;
+                uint64_t m_next_sequence;
+                std::unordered_map<::winrt::guid, size_t, GuidHash> m_id_index;
+                std::unordered_map<std::wstring, size_t> m_name_index;
+            };
+
+            // Routines sorted by start time, augmented as an implicit interval
+            // tree (every node records the maximum end time of its subtree),
+            // so that overlap queries cost O(log n + k) instead of O(n)
+            // NOTE: Intervals are half-open ([start, end)) and end > start
+            struct RoutineIntervalIndex {
+                struct Entry {
+                    uint64_t start;
+                    uint64_t end;
+                    uint64_t max_end;
+                    uint32_t slot;
+                };
+
+                RoutineIntervalIndex() : m_entries(), m_root_level(-1) {}
+
+                void insert(uint64_t start, uint64_t end, uint32_t slot);
+                bool erase(uint64_t start, uint32_t slot);
+                // Replaces all entries with the given ones (in any order),
+                // which are radix sorted by start time in O(n)
+                void assign(std::vector<Entry> entries);
+                // Removes all matching entries and inserts the given ones (in
+                // any order) with a single sort-merge pass, which costs
+                // O(n + k log k) instead of O(n) per entry
+                template<typename Pred>
+                void erase_if_and_merge(Pred pred, std::vector<Entry> entries) {
+                    auto it = std::remove_if(m_entries.begin(), m_entries.end(), pred);
+                    m_entries.erase(it, m_entries.end());
+                    std::sort(entries.begin(), entries.end(), [](Entry const& a, Entry const& b) {
+                        return a.start < b.start;
+                    });
+                    auto mid = m_entries.insert(m_entries.end(), entries.begin(), entries.end());
+                    std::inplace_merge(m_entries.begin(), mid, m_entries.end(), [](Entry const& a, Entry const& b) {
+                        return a.start < b.start;
+                    });
+                    this->prepare();
+                }
+                void clear(void);
+                size_t size(void) const { return m_entries.size(); }
+                bool empty(void) const { return m_entries.empty(); }
+                // NOTE: Entries are in ascending order of start time
+                std::vector<Entry> const& entries(void) const { return m_entries; }
+                // Returns the position of the first entry which starts no earlier than start
+                size_t lower_bound(uint64_t start) const;
+
+                // Calls fn(Entry const&) in ascending order of start time for
+                // every entry overlapping [start, end)
+                // NOTE: Read-only; safe to be called concurrently
+                template<typename Fn>
+                void for_each_overlapping(uint64_t start, uint64_t end, Fn&& fn) const {
+                    struct StackItem {
+                        int64_t x;
+                        int level;
+                        bool left_done;
+                    };
+                    if (m_entries.empty() || start >= end) {
+                        return;
+                    }
+                    auto const n = static_cast<int64_t>(m_entries.size());
+                    StackItem stack[64];
+                    int top = 0;
+                    stack[top++] = { (int64_t{ 1 } << m_root_level) - 1, m_root_level, false };
+                    while (top > 0) {
+                        auto cur = stack[--top];
+                        if (cur.level <= 3) {
+                            // Subtree is small enough; do a linear scan
+                            int64_t i = cur.x >> cur.level << cur.level;
+                            int64_t i_end = std::min(i + (int64_t{ 1 } << (cur.level + 1)) - 1, n);
+                            for (; i < i_end && m_entries[i].start < end; i++) {
+                                if (start < m_entries[i].end) {
+                                    fn(m_entries[i]);
+                                }
+                            }
+                        }
+                        else if (!cur.left_done) {
+                            // Revisit current node after its left subtree
+                            stack[top++] = { cur.x, cur.level, true };
+                            // NOTE: Left child may be out of range
+                            int64_t y = cur.x - (int64_t{ 1 } << (cur.level - 1));
+                            if (y >= n || m_entries[y].max_end > start) {
+                                stack[top++] = { y, cur.level - 1, false };
+                            }
+                        }
+                        else if (cur.x < n && m_entries[cur.x].start < end) {
+                            if (start < m_entries[cur.x].end) {
+                                fn(m_entries[cur.x]);
+                            }
+                            stack[top++] = { cur.x + (int64_t{ 1 } << (cur.level - 1)), cur.level - 1, false };
+                        }
+                    }
+                }
+            private:
+                // Recomputes max_end for all nodes in O(n)
+                // NOTE: Called eagerly by mutators, so that queries never
+                //       modify the index
+                void prepare(void);
+
+                std::vector<Entry> m_entries;
+                int m_root_level;
+            };
+
+            // Occurrences of repeating templates, expanded per (template, time
+            // bucket) on first use and shared by every view of the table, so
+            // that all users pay for expanding public templates only once
+            // NOTE: Thread-safe; filled lazily by readers
+            // NOTE: Shared by copies of a table until a template is modified,
+            //       after which the modified copy detaches and drops only the
+            //       entries of that template
+            struct OccurrenceCache {
+                struct Occurrence {
+                    uint64_t start_secs_since_epoch;
+                    ::winrt::guid id;
+                };
+                using Bucket = std::vector<Occurrence>;
+
+                OccurrenceCache() : m_mutex(), m_entries(), m_buckets_count(0) {}
+                OccurrenceCache(OccurrenceCache const& other);
+
+                // Returns occurrences of source starting within the given bucket
+                // (see bucket_of), in ascending order of start time
+                std::shared_ptr<Bucket const> get(RoutineDesc const& source, uint64_t bucket);
+                // Drops all entries of a template
+                void erase(::winrt::guid const& source_id);
+                static uint64_t bucket_of(uint64_t secs_since_epoch);
+                static uint64_t bucket_start(uint64_t bucket);
+            private:
+                mutable std::shared_mutex m_mutex;
+                std::unordered_map<
+                    ::winrt::guid,
+                    std::unordered_map<uint64_t, std::shared_ptr<Bucket const>>,
+                    GuidHash
+                > m_entries;
+                size_t m_buckets_count;
+            };
+
+            // Per-user state of a public routine which is otherwise used as is
+            // NOTE: Kept by personal tables instead of full copies of public
+            //       routines, so that ending a public routine costs each user
+            //       a few bytes rather than a copy of all its strings
+            struct PublicRoutineOverride {
+                bool is_ended;
+            };
+
+            // Routines of one owner, stored in stable slots and indexed by
+            // [start, start + duration) as well as by id
+            // NOTE: Routine ids are unique within a table
+            struct RoutineTable {
+                // Day (secs since epoch / SECS_PER_DAY) -> number of routines
+                using DerivedDays = std::map<uint64_t, uint32_t>;
+
+                RoutineTable() :
+                    m_ids(), m_starts(), m_durations(), m_colors(), m_flags(), m_slots(), m_free_slots(),
+                    m_index(), m_id_index(), m_repeating_index(), m_derived_index(), m_public_overrides(),
+                    m_occurrence_cache() {}
+
+                uint32_t insert(RoutineDesc routine);
+                void erase(uint32_t slot);
+                // Removes routines with the given ids (if present) and inserts
+                // or replaces the given routines, re-sorting the index only once
+                // NOTE: Ids must be unique across both arguments
+                void apply_batch(std::vector<RoutineDesc> routines, std::vector<::winrt::guid> const& removed_ids);
+                // Replaces all routines at once, building every index in a
+                // single pass; used for bulk loading
+                // NOTE: For duplicate ids, the last routine wins the id index
+                void assign(std::vector<RoutineDesc> routines);
+                void clear(void);
+                size_t size(void) const { return m_index.size(); }
+                bool empty(void) const { return m_index.empty(); }
+                // NOTE: Cold payload; scans should use the hot columns below
+                RoutineDesc const& operator[](uint32_t slot) const {
+                    this->assert_hot_columns_in_sync(slot);
+                    return m_slots[slot];
+                }
+                ::winrt::guid const& id(uint32_t slot) const { return m_ids[slot]; }
+                uint64_t start_secs(uint32_t slot) const { return m_starts[slot]; }
+                uint64_t duration_secs(uint32_t slot) const { return m_durations[slot]; }
+                uint32_t color(uint32_t slot) const { return m_colors[slot]; }
+                bool is_ended(uint32_t slot) const { return m_flags[slot] & FLAG_ENDED; }
+                RoutineTemplateKind template_kind(uint32_t slot) const {
+                    return static_cast<RoutineTemplateKind>(m_flags[slot] >> FLAG_TEMPLATE_KIND_SHIFT);
+                }
+                RoutineView view(uint32_t slot, RoutineViewKind kind) const {
+                    this->assert_hot_columns_in_sync(slot);
+                    return RoutineView{
+                        &m_slots[slot], m_starts[slot], kind,
+                        m_durations[slot], m_colors[slot], this->is_ended(slot)
+                    };
+                }
+                RoutineIntervalIndex const& index(void) const { return m_index; }
+                // NOTE: Template key -> slot for all repeating templates, in no
+                //       particular order; see routine_template_key
+                std::unordered_map<uint64_t, uint32_t> const& repeating_index(void) const {
+                    return m_repeating_index;
+                }
+
+                // NOTE: Visits routines in ascending order of start time
+                template<typename Fn>
+                void for_each(Fn&& fn) const {
+                    for (auto const& i : m_index.entries()) {
+                        fn(m_slots[i.slot]);
+                    }
+                }
+                // NOTE: Returns UINT32_MAX if not found
+                uint32_t find(::winrt::guid const& id) const {
+                    auto it = m_id_index.find(id);
+                    return it != m_id_index.end() ? it->second : UINT32_MAX;
+                }
+                bool contains(::winrt::guid const& id) const {
+                    return m_id_index.count(id) > 0;
+                }
+                // Days on which concrete routines derived from the given template
+                // exist (template -> occurrence dependency)
+                // NOTE: Returns nullptr if there is none
+                DerivedDays const* find_derived_days(::winrt::guid const& source_id) const {
+                    auto it = m_derived_index.find(source_id);
+                    return it != m_derived_index.end() ? &it->second : nullptr;
+                }
+                // NOTE: Returns UINT32_MAX if not found
+                uint32_t find_repeating(uint64_t template_key) const {
+                    auto it = m_repeating_index.find(template_key);
+                    return it != m_repeating_index.end() ? it->second : UINT32_MAX;
+                }
+                // NOTE: Overrides are keyed by public routine ids and are not
+                //       routines of the table (see size() and contains())
+                // NOTE: Returns nullptr if not found
+                PublicRoutineOverride const* find_public_override(::winrt::guid const& id) const {
+                    auto it = m_public_overrides.find(id);
+                    return it != m_public_overrides.end() ? &it->second : nullptr;
+                }
+                void set_public_override(::winrt::guid const& id, PublicRoutineOverride value) {
+                    m_public_overrides[id] = value;
+                }
+                bool erase_public_override(::winrt::guid const& id) {
+                    return m_public_overrides.erase(id) > 0;
+                }
+                std::unordered_map<::winrt::guid, PublicRoutineOverride, GuidHash> const& public_overrides(void) const {
+                    return m_public_overrides;
+                }
+                // NOTE: Only worth it for tables shared by many users' views
+                //       (i.e. public routines); disabled by default
+                void enable_occurrence_cache(void);
+                // NOTE: Returns nullptr if disabled
+                OccurrenceCache* occurrence_cache(void) const { return m_occurrence_cache.get(); }
+            private:
+                enum : uint8_t {
+                    FLAG_ENDED = 0x1,
+                    // RoutineTemplateKind is stored in the bits above
+                    FLAG_TEMPLATE_KIND_SHIFT = 1,
+                };
+
+                // Stores routine in a vacant slot without indexing it by time
+                uint32_t place_slot(RoutineDesc routine);
+                // NOTE: Hot fields are copies of the payload, which is still
+                //       stored whole; both are only written by place_slot and
+                //       release_slot. Checked in debug builds only.
+                void assert_hot_columns_in_sync([[maybe_unused]] uint32_t slot) const {
+                    assert(m_ids[slot] == m_slots[slot].id);
+                    assert(m_starts[slot] == m_slots[slot].start_secs_since_epoch);
+                    assert(m_durations[slot] == m_slots[slot].duration_secs);
+                    assert(m_colors[slot] == m_slots[slot].color);
+                    assert(this->is_ended(slot) == m_slots[slot].is_ended);
+                    assert(
+                        this->template_kind(slot) ==
+                        static_cast<RoutineTemplateKind>(m_slots[slot].template_options.index() + 1)
+                    );
+                }
+                void release_slot(uint32_t slot);
+                // Drops cached occurrences of a modified template
+                void forget_occurrences(::winrt::guid const& source_id);
+
+                // Hot fields, stored as dense per-slot columns so that range
+                // scans and filters never drag strings & template data through
+                // the cache
+                std::vector<::winrt::guid> m_ids;
+                std::vector<uint64_t> m_starts;
+                std::vector<uint64_t> m_durations;
+                std::vector<uint32_t> m_colors;
+                std::vector<uint8_t> m_flags;
+                // NOTE: Vacant slots are reset and recycled via m_free_slots
+                std::vector<RoutineDesc> m_slots;
+                std::vector<uint32_t> m_free_slots;
+                RoutineIntervalIndex m_index;
+                std::unordered_map<::winrt::guid, uint32_t, GuidHash> m_id_index;
+                std::unordered_map<uint64_t, uint32_t> m_repeating_index;
+                std::unordered_map<::winrt::guid, DerivedDays, GuidHash> m_derived_index;
+                std::unordered_map<::winrt::guid, PublicRoutineOverride, GuidHash> m_public_overrides;
+                std::shared_ptr<OccurrenceCache> m_occurrence_cache;
+            };
+
+            // NOTE: Owners are looked up by id on every query; hashed like
+            //       the id index of RoutineTable
+            using PersonalRoutineTables = std::unordered_map<::winrt::guid, std::shared_ptr<RoutineTable>, GuidHash>;
+
+            // Versions of the data a query result is computed from
+            // NOTE: Epochs are drawn from a single model-wide counter, so that
+            //       they never repeat, even across storage connections
+            struct RoutineEpochs {
+                uint64_t personal;
+                uint64_t public_routines;
+
+                bool operator==(RoutineEpochs const& other) const {
+                    return personal == other.personal && public_routines == other.public_routines;
+                }
+            };
+
+            // Bounded LRU cache of the routines seen by a single user, keyed by
+            // range, each entry being valid only for the epochs it was computed at
+            // NOTE: Thread-safe; every user has a cache (and a lock) of their own,
+            //       so that queries of different users never contend
+            // NOTE: Ranges are widened to whole buckets (see bucket_range), so
+            //       that nearby windows share entries; callers filter entries
+            //       down to the range they asked for
+            struct RangeResultCache {
+                using Routines = std::vector<RoutineDesc>;
+                struct Key {
+                    uint64_t start;
+                    uint64_t end;
+
+                    bool operator==(Key const& other) const {
+                        return start == other.start && end == other.end;
+                    }
+                };
+
+                RangeResultCache();
+
+                // Smallest range of whole buckets containing [start, end)
+                static Key bucket_range(uint64_t start, uint64_t end);
+                // NOTE: Returns nullptr if there is no entry valid for epochs
+                std::shared_ptr<Routines const> find(Key const& key, RoutineEpochs const& epochs);
+                // NOTE: Replaces the (stale) entry of the same key, if any
+                void insert(Key const& key, RoutineEpochs const& epochs, std::shared_ptr<Routines const> value);
+                uint64_t hits(void) const { return m_hits; }
+                uint64_t misses(void) const { return m_misses; }
+            private:
+                struct KeyHash {
+                    size_t operator()(Key const& key) const noexcept {
+                        return static_cast<size_t>(mix_u64(key.start ^ mix_u64(key.end)));
+                    }
+                };
+                struct Entry {
+                    Key key;
+                    RoutineEpochs epochs;
+                    std::shared_ptr<Routines const> value;
+                };
+
+                std::mutex m_mutex;
+                // NOTE: Most recently used first
+                std::list<Entry> m_lru;
+                std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_index;
+                std::atomic<uint64_t> m_hits, m_misses;
+            };
+
+            // Personal routines of a user to be ended automatically (see
+            // RoutineEndTriggerKind::Expiry), in a min-heap keyed on their ends
+            // NOTE: Not thread-safe; guarded by the lock of the partition owning it
+            // NOTE: Entries are not verified against routines until they are
+            //       due; the routine may have been removed or modified since
+            //       then. Rescheduling a routine invalidates its older entries.
+            struct ExpiryQueue {
+                struct Entry {
+                    uint64_t end_secs_since_epoch;
+                    ::winrt::guid routine_id;
+                };
+
+                ExpiryQueue() : m_heap(), m_ends() {}
+
+                // Whether routine is ended automatically once it ends
+                // NOTE: Ghosts and templates are excluded, as they are not
+                //       stored per occurrence
+                static bool is_expiring(RoutineDesc const& routine);
+                // Schedules routine if it is expiring, or cancels it otherwise
+                // NOTE: Only routines which are expiring are ever scheduled, so
+                //       callers skip this if neither routine nor the version it
+                //       replaces is expiring
+                void schedule(RoutineDesc const& routine);
+                void cancel(::winrt::guid const& routine_id);
+                // End of the earliest entry (possibly a stale one), or
+                // UINT64_MAX if there is none
+                uint64_t next_end(void) const;
+                // Removes and returns entries due at or before now, in ascending
+                // order of end time
+                std::vector<Entry> take_due(uint64_t now_secs_since_epoch);
+            private:
+                // Drops invalidated entries once they outnumber valid ones
+                void compact_if_needed(void);
+
+                std::vector<Entry> m_heap;
+                // NOTE: Current end of every scheduled routine; heap entries
+                //       with other ends are stale
+                std::unordered_map<::winrt::guid, uint64_t, GuidHash> m_ends;
+            };
+
+            // Routines of one user, along with the reader/writer lock guarding them
+            struct PersonalPartition {
+                explicit PersonalPartition(uint64_t epoch) :
+                    PersonalPartition(std::make_shared<RoutineTable>(), epoch) {}
+                PersonalPartition(std::shared_ptr<RoutineTable> routines, uint64_t epoch) :
+                    mutex(), routines(std::move(routines)), epoch(epoch),
+                    range_cache(std::make_shared<RangeResultCache>()), expiry_queue() {}
+
+                std::shared_mutex mutex;
+                std::shared_ptr<RoutineTable> routines;
+                // NOTE: Renewed whenever routines are modified; see RoutineEpochs
+                uint64_t epoch;
+                // NOTE: Not guarded by mutex; shared, so that queries can keep
+                //       using it after the partition lock is released
+                std::shared_ptr<RangeResultCache> range_cache;
+                // NOTE: Updated along with routines
+                ExpiryQueue expiry_queue;
+            };
+            using PersonalPartitions = std::unordered_map<::winrt::guid, std::unique_ptr<PersonalPartition>, GuidHash>;
+
+        }
+
+        // NOTE: Data segments (users, public routines, routines of each user)
+        //       are shared with the model and only copied when the model
+        //       modifies a segment which is still pinned by some snapshot
+        // NOTE: Queries behave the same as their CoreAppModel counterparts
+        struct implementation::CoreAppModelSnapshot {
+            CoreAppModelSnapshot(
+                std::shared_ptr<UserDirectory const> users,
+                std::shared_ptr<RoutineTable const> routines_public,
+                std::shared_ptr<PersonalRoutineTables const> routines_personal
+            );
+
+            const std::vector<UserDesc>& get_users() const { return m_users->users(); }
+            bool try_lookup_user(::winrt::guid user_id, UserDesc& desc) const;
+            bool try_lookup_routine(::winrt::guid user_id, ::winrt::guid routine_id, RoutineDesc* routine) const;
+            bool is_public_routine(::winrt::guid routine_id) const;
+            bool try_decode_ghost_routine_id(
+                ::winrt::guid user_id,
+                ::winrt::guid routine_id,
+                ::winrt::guid& source_routine,
+                uint64_t& secs_since_epoch_start
+            ) const;
+            bool try_get_routines_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint64_t secs_since_epoch_end,
+                std::vector<RoutineDesc>& routines
+            ) const;
+            // NOTE: Views stay valid for as long as the snapshot is alive
+            bool try_visit_routines_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint64_t secs_since_epoch_end,
+                std::function<void(RoutineView const&)> const& fn
+            ) const;
+            bool try_get_upcoming_routines_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                size_t count,
+                std::vector<RoutineDesc>& routines
+            ) const;
+            bool try_get_routine_day_summaries_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint32_t days_count,
+                std::vector<RoutineDaySummary>& summaries
+            ) const;
+            bool try_get_routine_conflicts_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint64_t secs_since_epoch_end,
+                std::vector<RoutineConflict>& conflicts
+            ) const;
+            bool try_get_conflicts_with_routine(
+                ::winrt::guid user_id,
+                RoutineDesc const& routine,
+                std::vector<RoutineDesc>& conflicts
+            ) const;
+            bool try_find_free_slots_from_user_view(
+                ::winrt::guid user_id,
+                FreeSlotQuery const& query,
+                std::vector<std::pair<uint64_t, uint64_t>>& slots
+            ) const;
+            bool try_find_common_free_slots(
+                std::vector<::winrt::guid> const& user_ids,
+                FreeSlotQuery const& query,
+                std::vector<std::pair<uint64_t, uint64_t>>& slots
+            ) const;
+        private:
+            friend struct CoreAppModel;
+
+            // NOTE: Returns nullptr if the user does not exist
+            RoutineTable const* find_personal_routines(::winrt::guid const& user_id) const;
+
+            std::shared_ptr<UserDirectory const> m_users;
+            std::shared_ptr<RoutineTable const> m_routines_public;
+            std::shared_ptr<PersonalRoutineTables const> m_routines_personal;
+        };
 
         struct implementation::CoreAppModel {
             CoreAppModel();
@@ -183,8 +866,21 @@ namespace RoutineArranger {
             * }
             */
 
-            const std::vector<UserDesc>& get_users() { return m_users; }
+            // Pins the current version of the model
+            // NOTE: Snapshots can be read on worker threads (e.g. for search or
+            //       rendering) without blocking, and never observe changes made
+            //       after they were taken
+            std::shared_ptr<CoreAppModelSnapshot> snapshot(void);
+
+            // WARN: Not synchronized; take a snapshot on other threads
+            // NOTE: In creation order unless users have been removed
+            const std::vector<UserDesc>& get_users() { return m_users->users(); }
             bool create_user(const wchar_t* name, const wchar_t* nickname, bool is_admin);
+            // NOTE: All-or-nothing; fails without creating any user if any
+            //       entry is invalid or any name collides (including within
+            //       the batch itself)
+            // NOTE: user_ids (optional) receives ids in the same order as users
+            bool create_users(std::vector<NewUserDesc> const& users, std::vector<::winrt::guid>* user_ids = nullptr);
             bool try_lookup_user(::winrt::guid user_id, UserDesc& desc);
             // NOTE: User name will be ignored during the update
             bool try_update_user(UserDesc const& desc);
@@ -194,12 +890,103 @@ namespace RoutineArranger {
             // NOTE: No authentication is applied here; user_id may be empty
             //       (in which case the public routines will be searched)
             bool try_lookup_routine(::winrt::guid user_id, ::winrt::guid routine_id, RoutineDesc* routine);
+            // NOTE: Same as try_lookup_routine(GUID{}, routine_id, nullptr)
+            bool is_public_routine(::winrt::guid routine_id);
+            // NOTE: Ids of ghosts derived from repeating templates are stable
+            //       and encode their source; this maps such an id back to the
+            //       template and the start time of the occurrence
+            bool try_decode_ghost_routine_id(
+                ::winrt::guid user_id,
+                ::winrt::guid routine_id,
+                ::winrt::guid& source_routine,
+                uint64_t& secs_since_epoch_start
+            );
+            // NOTE: Returns all routines overlapping [start, end) (rather than
+            //       only those starting within the range), in ascending order
+            //       of start time
+            // NOTE: Ghosts are generated on the fly without modifying the model
+            // NOTE: Range queries (including the ones below) fail if start >= end
             bool try_get_routines_from_user_view(
                 ::winrt::guid user_id,
                 uint64_t secs_since_epoch_start,
                 uint64_t secs_since_epoch_end,
                 std::vector<RoutineDesc>& routines
             );
+            // NOTE: Visitor version of try_get_routines_from_user_view which
+            //       copies nothing; fn is called for each routine in order
+            // NOTE: Views refer to a snapshot pinned during the call, and are
+            //       only valid within fn
+            bool try_visit_routines_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint64_t secs_since_epoch_end,
+                std::function<void(RoutineView const&)> const& fn
+            );
+            // NOTE: routines receives the first count routines (including
+            //       ghosts) overlapping [secs_since_epoch_start, +inf), in
+            //       ascending order of start time; there is no need to guess
+            //       a range, even with infinitely repeating templates
+            // NOTE: Templates, concrete and public routines are merged lazily,
+            //       so the cost is O(T + count * log T) for T templates
+            bool try_get_upcoming_routines_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                size_t count,
+                std::vector<RoutineDesc>& routines
+            );
+            // NOTE: summaries[i] summarizes the day starting at
+            //       secs_since_epoch_start + i * SECS_PER_DAY, for days_count days
+            // NOTE: Computed straight from the index; no routine is copied,
+            //       so this is the cheapest way of rendering calendars
+            bool try_get_routine_day_summaries_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint32_t days_count,
+                std::vector<RoutineDaySummary>& summaries
+            );
+            // NOTE: Finds groups of routines (including ghosts) overlapping each
+            //       other within [start, end), with a single sweep over the
+            //       sorted view, i.e. O(n log n) rather than comparing pairs
+            // NOTE: Only routines overlapping the range are taken into account
+            bool try_get_routine_conflicts_from_user_view(
+                ::winrt::guid user_id,
+                uint64_t secs_since_epoch_start,
+                uint64_t secs_since_epoch_end,
+                std::vector<RoutineConflict>& conflicts
+            );
+            // NOTE: Finds routines (including ghosts) overlapping routine, which
+            //       need not exist yet; meant to be called before committing it
+            //       with try_update_routine_from_user_view
+            // NOTE: Routine itself (same id, including the ghost being edited
+            //       if routine is an occurrence) and ghosts derived from its
+            //       stored version are excluded; for repeating templates, only
+            //       the first occurrence is checked
+            bool try_get_conflicts_with_routine(
+                ::winrt::guid user_id,
+                RoutineDesc const& routine,
+                std::vector<RoutineDesc>& conflicts
+            );
+            // NOTE: slots receives [start, end) periods within the query range
+            //       not covered by any routine (including ghosts), in ascending
+            //       order, clipped to working hours if given
+            // NOTE: Busy periods are merged on the fly while walking the sorted
+            //       view; with max_count set (e.g. "next free 45 minutes"), the
+            //       walk stops as soon as enough slots are found
+            bool try_find_free_slots_from_user_view(
+                ::winrt::guid user_id,
+                FreeSlotQuery const& query,
+                std::vector<std::pair<uint64_t, uint64_t>>& slots
+            );
+            // NOTE: Same as above, but slots are free for all the given users
+            //       (e.g. for scheduling meetings); fails if any user does
+            //       not exist
+            // NOTE: Busy periods of users are collected in parallel, then
+            //       merged with a k-way merge
+            bool try_find_common_free_slots(
+                std::vector<::winrt::guid> const& user_ids,
+                FreeSlotQuery const& query,
+                std::vector<std::pair<uint64_t, uint64_t>>& slots
+            );
             bool try_update_routine_from_user_view(
                 ::winrt::guid user_id,
                 RoutineDesc const& routine
@@ -207,14 +994,99 @@ namespace RoutineArranger {
             bool try_remove_routine_from_user_view(::winrt::guid user_id, ::winrt::guid routine_id);
             void update_public_routine(RoutineDesc const& routine);
             bool try_remove_public_routine(::winrt::guid routine_id);
+            // NOTE: Applies the whole batch to the routines of a user (or the
+            //       public routines if user_id is empty) at once, marking the
+            //       storage dirty only once; much cheaper than updating routines
+            //       one by one when importing or editing many of them
+            // NOTE: All-or-nothing; fails without modifying anything if any id
+            //       is duplicated or any routine to be removed does not exist
+            bool try_apply_routine_batch(::winrt::guid user_id, RoutineBatch const& batch);
+            // NOTE: Places tasks into free time of the user (around existing
+            //       routines, including ghosts) and commits the placed ones in
+            //       a single batch; arrangement receives what has been done
+            // NOTE: Greedy in order of deadlines: each task takes the earliest
+            //       free period it fits into, which is then split up. Tasks
+            //       which cannot meet their deadlines are left unplaced.
+            // NOTE: The user is locked throughout, so that the arrangement
+            //       never overlaps routines added concurrently
+            bool try_arrange_tasks_for_user(
+                ::winrt::guid user_id,
+                std::vector<FlexibleTaskDesc> const& tasks,
+                TaskArrangement& arrangement
+            );
+            // NOTE: Ends (sets is_ended of) personal routines with
+            //       RoutineEndTriggerKind::Expiry whose end is at or before
+            //       now, and returns how many routines have been ended
+            // NOTE: Expected to be called periodically; routines of each user
+            //       are kept in a queue ordered by their ends, so the cost is a
+            //       peek per user plus the routines due, and each user is
+            //       modified in a single batch
+            // NOTE: Public routines (and ghosts derived from templates) are not
+            //       ended automatically, as their per-user state is not stored
+            //       until a user modifies them
+            size_t expire_due_routines(uint64_t now_secs_since_epoch);
+
+            // NOTE: Results of try_get_routines_from_user_view and
+            //       try_get_routine_day_summaries_from_user_view are cached
+            //       until the routines they depend on are modified
+            RangeCacheStats get_range_cache_stats(void);
         private:
+            // NOTE: Pins the partitions of the given users only, or all of
+            //       them if user_ids is nullptr
+            // NOTE: epochs (optional) receives the epochs of the pinned data,
+            //       and range_cache (optional) the range cache of the pinned
+            //       user (nullptr if there is no such user); both are only
+            //       meaningful for a single user
+            std::shared_ptr<CoreAppModelSnapshot> pin_snapshot(
+                ::winrt::guid const* user_ids,
+                size_t user_ids_count,
+                RoutineEpochs* epochs = nullptr,
+                std::shared_ptr<RangeResultCache>* range_cache = nullptr
+            );
+            std::shared_ptr<CoreAppModelSnapshot> pin_snapshot(
+                ::winrt::guid const* user_id,
+                RoutineEpochs* epochs = nullptr,
+                std::shared_ptr<RangeResultCache>* range_cache = nullptr
+            ) {
+                return this->pin_snapshot(user_id, 1, epochs, range_cache);
+            }
+            // Routines seen by a user within the buckets containing [start, end)
+            // (see RangeResultCache::bucket_range), read from the cache of the
+            // user if still valid
+            // NOTE: Returns nullptr if there is no such user, or start >= end
+            std::shared_ptr<std::vector<RoutineDesc> const> get_bucketed_routines(
+                ::winrt::guid const& user_id,
+                uint64_t start,
+                uint64_t end
+            );
+            // Whether routine can be kept as an override of the public routine
+            // with the same id; see PublicRoutineOverride
+            // NOTE: Takes m_routines_public_mutex
+            bool can_override_public_routine(RoutineDesc const& routine);
+
+            // NOTE: Guards storage connection & flushing
+            std::recursive_mutex m_storage_mutex;
             std::wstring m_storage_path;
             std::fstream m_file_lock;
-            bool m_index_cfg_need_flush, m_routines_cfg_need_flush;
 
-            std::vector<UserDesc> m_users;
-            std::vector<RoutineDesc> m_routines_public;
-            std::map<::winrt::guid, std::vector<RoutineDesc>> m_routines_personal;
+            std::atomic<bool> m_index_cfg_need_flush, m_routines_cfg_need_flush;
+            // NOTE: Data is partitioned (users, public routines, routines of each
+            //       user), each partition being guarded by its own reader/writer
+            //       lock, so that operations on different users never contend.
+            //       Writers hold the lock during the whole modification, while
+            //       readers only hold it to pin a snapshot.
+            // NOTE: Lock order: m_users_mutex -> PersonalPartition::mutex; no
+            //       other lock is taken while m_routines_public_mutex is held
+            // NOTE: m_users_mutex also guards the set of personal partitions
+            std::shared_mutex m_users_mutex;
+            std::shared_ptr<UserDirectory> m_users;
+            PersonalPartitions m_routines_personal;
+            std::shared_mutex m_routines_public_mutex;
+            std::shared_ptr<RoutineTable> m_routines_public;
+            uint64_t m_routines_public_epoch;
+
+            // NOTE: Source of all epochs; see RoutineEpochs
+            std::atomic<uint64_t> m_epoch_counter;
         };
     }
 }
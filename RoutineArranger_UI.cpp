@@ -14,7 +14,7 @@ using namespace winrt;
 
 const uint64_t SECS_PER_MINUTE = 60;
 const uint64_t SECS_PER_HOUR = SECS_PER_MINUTE * 60;
-const uint64_t SECS_PER_DAY = SECS_PER_HOUR * 24;
+using RoutineArranger::Core::SECS_PER_DAY;
 
 template<typename T>
 auto time_point_to_tm(T const& time_point) {
@@ -666,7 +666,7 @@ namespace RoutineArranger::UI::implementation {
                         auto model = m_root_pre->get_model();
                         auto cur_user = m_root_pre->get_active_user_id();
                         model->try_update_routine_from_user_view(cur_user, cur_routine);
-                        if (model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr)) {
+                        if (model->is_public_routine(cur_routine.id)) {
                             model->update_public_routine(cur_routine);
                         }
                         // NOTE: Routine ordering in list is not updated on
@@ -712,7 +712,7 @@ namespace RoutineArranger::UI::implementation {
                         auto model = m_root_pre->get_model();
                         auto cur_user = m_root_pre->get_active_user_id();
                         model->try_update_routine_from_user_view(cur_user, cur_routine);
-                        if (model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr)) {
+                        if (model->is_public_routine(cur_routine.id)) {
                             model->update_public_routine(cur_routine);
                         }
                         this->update_cur_day_routines_ui_item(static_cast<uint32_t>(idx));
@@ -773,7 +773,7 @@ namespace RoutineArranger::UI::implementation {
                 auto model = m_root_pre->get_model();
                 auto cur_user = m_root_pre->get_active_user_id();
                 model->try_update_routine_from_user_view(cur_user, cur_routine);
-                if (model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr)) {
+                if (model->is_public_routine(cur_routine.id)) {
                     model->update_public_routine(cur_routine);
                 }
                 this->update_cur_day_routines_ui_item(static_cast<uint32_t>(idx));
@@ -826,7 +826,7 @@ namespace RoutineArranger::UI::implementation {
             auto model = m_root_pre->get_model();
             auto cur_user = m_root_pre->get_active_user_id();
             model->try_update_routine_from_user_view(cur_user, cur_routine);
-            if (model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr)) {
+            if (model->is_public_routine(cur_routine.id)) {
                 model->update_public_routine(cur_routine);
             }
             this->update_cur_day_routines_ui_item(static_cast<uint32_t>(idx));
@@ -1263,7 +1263,7 @@ namespace RoutineArranger::UI::implementation {
         ));
         tb_time.Inlines().Append(tb_time_r2);
         // Mark if routine comes from public
-        if (m_root_pre->get_model()->try_lookup_routine(::winrt::guid{ GUID{} }, rd.id, nullptr)) {
+        if (m_root_pre->get_model()->is_public_routine(rd.id)) {
             auto tb_time_rs = Windows::UI::Xaml::Documents::Run();
             tb_time_rs.FontWeight(FontWeights::Bold());
             tb_time_rs.Text(L"  ·  ");
@@ -1358,6 +1358,10 @@ namespace RoutineArranger::UI::implementation {
         auto cur_time = time_point_to_secs_since_epoch(m_cur_time + m_day_offset * 24h + m_cur_tz_offset);
         cur_time = (cur_time / SECS_PER_DAY) * SECS_PER_DAY;
         cur_time -= duration_to_secs(m_cur_tz_offset);
+        // NOTE: Routines ending on expiry are ended right before being shown
+        m_root_pre->get_model()->expire_due_routines(
+            time_point_to_secs_since_epoch(std::chrono::system_clock::now())
+        );
         if (!m_root_pre->get_model()->try_get_routines_from_user_view(
             m_root_pre->get_active_user_id(),
             cur_time,
@@ -1442,7 +1446,7 @@ namespace RoutineArranger::UI::implementation {
         else {
             bool is_repeating =
                 std::holds_alternative<RoutineDescTemplate_Repeating>(cur_routine.template_options);
-            bool is_public = model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr);
+            bool is_public = model->is_public_routine(cur_routine.id);
             if (is_public) {
                 UserDesc ud;
                 if (!model->try_lookup_user(cur_user, ud)) {
@@ -1524,7 +1528,7 @@ namespace RoutineArranger::UI::implementation {
                             // Size was already changed; short-circuit out
                             return;
                         }
-                        repeating->repeat_days_flags[i] = value;
+                        repeating->repeat_days_flags.set(i, value);
                         auto idx = m_lv_routines.SelectedIndex();
                         if (idx == -1) {
                             throw hresult_error(E_FAIL, L"从 Details.RepeatByDayFlagCheckBox 触发更新时遇到了意外的日程下标");
@@ -1533,7 +1537,7 @@ namespace RoutineArranger::UI::implementation {
                         auto model = m_root_pre->get_model();
                         auto cur_user = m_root_pre->get_active_user_id();
                         model->try_update_routine_from_user_view(cur_user, cur_routine);
-                        if (model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr)) {
+                        if (model->is_public_routine(cur_routine.id)) {
                             model->update_public_routine(cur_routine);
                         }
                     };
@@ -1673,7 +1677,7 @@ namespace RoutineArranger::UI::implementation {
             auto model = m_root_pre->get_model();
             auto cur_user = m_root_pre->get_active_user_id();
             model->try_update_routine_from_user_view(cur_user, cur_routine);
-            if (model->try_lookup_routine(::winrt::guid{ GUID{} }, cur_routine.id, nullptr)) {
+            if (model->is_public_routine(cur_routine.id)) {
                 model->update_public_routine(cur_routine);
             }
         }
@@ -1808,10 +1812,27 @@ namespace RoutineArranger::UI::implementation {
         };
         auto cvdi_container = hack_get_cvdi_container_fn();
         if (cvdi_container) {
+            // NOTE: Query all visible days at once instead of one by one
+            std::vector<std::pair<CalendarViewDayItem, uint64_t>> items;
+            uint64_t time_begin_min = UINT64_MAX, time_begin_max = 0;
             auto children_count = VisualTreeHelper::GetChildrenCount(cvdi_container);
             for (decltype(children_count) i = 0; i < children_count; i++) {
                 if (auto item = VisualTreeHelper::GetChild(cvdi_container, i).try_as<CalendarViewDayItem>()) {
-                    update_calendar_view_day_item(item);
+                    auto cur_time_begin = get_calendar_view_day_item_time_begin(item);
+                    items.emplace_back(item, cur_time_begin);
+                    time_begin_min = std::min(time_begin_min, cur_time_begin);
+                    time_begin_max = std::max(time_begin_max, cur_time_begin);
+                }
+            }
+            std::vector<RoutineArranger::Core::RoutineDaySummary> summaries;
+            if (!items.empty() && m_root_pre->get_model()->try_get_routine_day_summaries_from_user_view(
+                m_root_pre->get_active_user_id(),
+                time_begin_min,
+                static_cast<uint32_t>((time_begin_max - time_begin_min) / SECS_PER_DAY + 1),
+                summaries
+            )) {
+                for (auto const& [item, cur_time_begin] : items) {
+                    update_calendar_view_day_item(item, summaries[(cur_time_begin - time_begin_min) / SECS_PER_DAY]);
                 }
             }
         }
@@ -1831,28 +1852,36 @@ namespace RoutineArranger::UI::implementation {
         }
         update_calendar_view_day_item(e.Item());
     }
-    void MonthViewContainerPresenter::update_calendar_view_day_item(CalendarViewDayItem const& item) {
+    uint64_t MonthViewContainerPresenter::get_calendar_view_day_item_time_begin(CalendarViewDayItem const& item) {
         // NOTE: winrt::clock::to_sys is required in order to ensure consistent epochs
         auto cur_time_begin = time_point_to_secs_since_epoch(winrt::clock::to_sys(item.Date()) + m_cur_tz_offset);
         cur_time_begin = (cur_time_begin / SECS_PER_DAY) * SECS_PER_DAY;
         cur_time_begin -= duration_to_secs(m_cur_tz_offset);
-        std::vector<RoutineArranger::Core::RoutineDesc> routines;
-        if (!m_root_pre->get_model()->try_get_routines_from_user_view(
+        return cur_time_begin;
+    }
+    void MonthViewContainerPresenter::update_calendar_view_day_item(CalendarViewDayItem const& item) {
+        auto cur_time_begin = get_calendar_view_day_item_time_begin(item);
+        std::vector<RoutineArranger::Core::RoutineDaySummary> summaries;
+        if (!m_root_pre->get_model()->try_get_routine_day_summaries_from_user_view(
             m_root_pre->get_active_user_id(),
             cur_time_begin,
-            cur_time_begin + SECS_PER_DAY,
-            routines
+            1,
+            summaries
         )) {
             // Fail silently
             return;
         }
+        update_calendar_view_day_item(item, summaries[0]);
+    }
+    void MonthViewContainerPresenter::update_calendar_view_day_item(
+        CalendarViewDayItem const& item,
+        RoutineArranger::Core::RoutineDaySummary const& summary
+    ) {
         std::vector<Color> colors;
         std::transform(
-            routines.begin(), routines.end(),
+            summary.colors.begin(), summary.colors.end(),
             std::back_inserter(colors),
-            [](RoutineArranger::Core::RoutineDesc const& v) {
-                return u32_color_to_winrt(v.color);
-            }
+            u32_color_to_winrt
         );
         item.SetDensityColors(colors);
     }
@@ -1926,7 +1955,7 @@ namespace RoutineArranger::UI::implementation {
         ));
         tb_time.Inlines().Append(tb_time_r2);
         // Mark if routine comes from public
-        if (m_root_pre->get_model()->try_lookup_routine(::winrt::guid{ GUID{} }, rd.id, nullptr)) {
+        if (m_root_pre->get_model()->is_public_routine(rd.id)) {
             auto tb_time_rs = Windows::UI::Xaml::Documents::Run();
             tb_time_rs.FontWeight(FontWeights::Bold());
             tb_time_rs.Text(L"  ·  ");
@@ -2010,6 +2039,10 @@ namespace RoutineArranger::UI::implementation {
         auto cur_time = time_point_to_secs_since_epoch(given_time + m_cur_tz_offset);
         cur_time = (cur_time / SECS_PER_DAY) * SECS_PER_DAY;
         cur_time -= duration_to_secs(m_cur_tz_offset);
+        // NOTE: Routines ending on expiry are ended right before being shown
+        m_root_pre->get_model()->expire_due_routines(
+            time_point_to_secs_since_epoch(std::chrono::system_clock::now())
+        );
         if (!m_root_pre->get_model()->try_get_routines_from_user_view(
             m_root_pre->get_active_user_id(),
             cur_time,
@@ -2607,50 +2640,50 @@ namespace RoutineArranger::UI::implementation {
         // --------------------
         std::vector<RoutineArranger::Core::RoutineDesc> result_routines;
 
-        m_root_pre->get_model()->try_get_routines_from_user_view(
+        // NOTE: Routines are only copied after passing all filters
+        uint64_t range_start = day_start * SECS_PER_DAY - duration_to_secs(m_cur_tz_offset);
+        m_root_pre->get_model()->try_visit_routines_from_user_view(
             m_root_pre->get_active_user_id(),
-            day_start * SECS_PER_DAY - duration_to_secs(m_cur_tz_offset),
+            range_start,
             (day_end + 1) * SECS_PER_DAY - duration_to_secs(m_cur_tz_offset),
-            result_routines
-        );
-        // Routines will be removed where pred returns true
-        auto filter_routines_fn = [&](auto pred) {
-            result_routines.erase(
-                std::remove_if(result_routines.begin(), result_routines.end(), pred),
-                result_routines.end()
-            );
-        };
-        // Filter time
-        filter_routines_fn([&](RoutineArranger::Core::RoutineDesc const& rd) {
-            auto start_time = rd.start_secs_since_epoch + duration_to_secs(m_cur_tz_offset);
-            auto day_start_time = start_time % SECS_PER_DAY;
-            return !(day_secs_start <= day_start_time && day_start_time <= day_secs_end);
-        });
-        // Filter is_ended
-        filter_routines_fn([&](RoutineArranger::Core::RoutineDesc const& rd) {
-            if (!filter_ended_set) {
-                return false;
-            }
-            return rd.is_ended != filter_ended;
-        });
-        // Filter description
-        filter_routines_fn([&](RoutineArranger::Core::RoutineDesc const& rd) {
-            return std::any_of(
-                filter_descriptions.begin(), filter_descriptions.end(),
-                [&](std::wstring_view str) {
-                    return rd.description.find(str) == rd.description.npos;
+            [&](RoutineArranger::Core::RoutineView const& v) {
+                // NOTE: Only routines starting within the searched days are
+                //       matched, not those running into them
+                if (v.start_secs_since_epoch < range_start) {
+                    return;
                 }
-            );
-        });
-        // Filter title
-        filter_routines_fn([&](RoutineArranger::Core::RoutineDesc const& rd) {
-            return std::any_of(
-                filter_titles.begin(), filter_titles.end(),
-                [&](std::wstring_view str) {
-                    return rd.name.find(str) == rd.name.npos;
+                // Filter time
+                auto start_time = v.start_secs_since_epoch + duration_to_secs(m_cur_tz_offset);
+                auto day_start_time = start_time % SECS_PER_DAY;
+                if (!(day_secs_start <= day_start_time && day_start_time <= day_secs_end)) {
+                    return;
                 }
-            );
-        });
+                // Filter is_ended
+                if (filter_ended_set && v.is_ended != filter_ended) {
+                    return;
+                }
+                auto const& rd = *v.source;
+                // Filter description
+                if (std::any_of(
+                    filter_descriptions.begin(), filter_descriptions.end(),
+                    [&](std::wstring_view str) {
+                        return rd.description.find(str) == rd.description.npos;
+                    }
+                )) {
+                    return;
+                }
+                // Filter title
+                if (std::any_of(
+                    filter_titles.begin(), filter_titles.end(),
+                    [&](std::wstring_view str) {
+                        return rd.name.find(str) == rd.name.npos;
+                    }
+                )) {
+                    return;
+                }
+                result_routines.push_back(v.to_routine_desc());
+            }
+        );
 
         m_tb_lv_routines_footer.Text(wstrprintf(
             L"找到了 %zu 项日程",
@@ -2783,7 +2816,7 @@ namespace RoutineArranger::UI::implementation {
                 ));
                 tb_time.Inlines().Append(tb_time_r2);
                 // Mark if routine comes from public
-                if (m_root_pre->get_model()->try_lookup_routine(::winrt::guid{ GUID{} }, rd.id, nullptr)) {
+                if (m_root_pre->get_model()->is_public_routine(rd.id)) {
                     auto tb_time_rs = Windows::UI::Xaml::Documents::Run();
                     tb_time_rs.FontWeight(FontWeights::Bold());
                     tb_time_rs.Text(L"  ·  ");
@@ -134,9 +134,16 @@ namespace RoutineArranger {
                 Windows::UI::Xaml::Controls::CalendarView const& sender,
                 Windows::UI::Xaml::Controls::CalendarViewDayItemChangingEventArgs const& e
             );
+            uint64_t get_calendar_view_day_item_time_begin(
+                Windows::UI::Xaml::Controls::CalendarViewDayItem const& item
+            );
             void update_calendar_view_day_item(
                 Windows::UI::Xaml::Controls::CalendarViewDayItem const& item
             );
+            void update_calendar_view_day_item(
+                Windows::UI::Xaml::Controls::CalendarViewDayItem const& item,
+                RoutineArranger::Core::RoutineDaySummary const& summary
+            );
             void update_day_routines_ui_item(uint32_t idx);
             void update_day(Windows::Foundation::DateTime const& dt);
 
@@ -0,0 +1,71 @@
+#pragma once
+
+// Helpers shared by the benchmarks
+// NOTE: All benchmarks are built into one console program by
+//       RoutineArranger.Benchmarks.vcxproj; see bench_main.cpp for how
+//       to run them. Build the Release configuration for meaningful numbers.
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "RoutineArranger_Core.h"
+#include "util.h"
+
+namespace bench {
+    using namespace RoutineArranger::Core;
+
+    // NOTE: Synthetic calendars are placed around this point in time
+    const uint64_t BASE_SECS_SINCE_EPOCH = 1700000000;
+
+    inline RoutineDesc make_routine(uint64_t start, uint64_t duration, const wchar_t* name = L"routine") {
+        RoutineDesc routine{};
+        routine.id = util::winrt::gen_random_guid();
+        routine.start_secs_since_epoch = start;
+        routine.duration_secs = duration;
+        routine.name = name;
+        routine.end_trigger_kind = RoutineEndTriggerKind::Manual;
+        routine.template_options = nullptr;
+        return routine;
+    }
+    // Template repeating on the first days_count days of every week, forever
+    inline RoutineDesc make_weekly_template(uint64_t start, uint64_t duration, size_t days_count) {
+        RoutineDesc routine = make_routine(start, duration, L"weekly");
+        RoutineDescTemplate_Repeating repeating{};
+        repeating.repeat_days_cycle = 7;
+        // Repeat infinite times
+        repeating.repeat_cycles = 0;
+        repeating.repeat_days_flags.resize(7);
+        for (size_t i = 0; i < days_count; i++) {
+            repeating.repeat_days_flags.set(i, true);
+        }
+        routine.template_options = repeating;
+        return routine;
+    }
+    // Source: 64-bit LCG (Knuth)
+    inline uint64_t next_random(uint64_t& state) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return state >> 33;
+    }
+    // Creates users named user0, user1, ... and returns their ids
+    inline std::vector<::winrt::guid> make_users(CoreAppModel const& model, size_t count) {
+        std::vector<NewUserDesc> new_users;
+        for (size_t i = 0; i < count; i++) {
+            new_users.push_back({ L"user" + std::to_wstring(i), L"user", false });
+        }
+        std::vector<::winrt::guid> user_ids;
+        model->create_users(new_users, &user_ids);
+        return user_ids;
+    }
+    inline double elapsed_ms(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // Latency of day-cell queries against repeating templates of growing age
+    void run_template_age(void);
+    // Throughput of mixed per-user reads and writes as threads are added
+    void run_stress_partitions(void);
+    // Arranging flexible tasks into synthetic calendars
+    void run_arrange_tasks(void);
+}
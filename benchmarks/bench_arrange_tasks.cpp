@@ -0,0 +1,60 @@
+// Benchmark: arranging flexible tasks into synthetic calendars
+// NOTE: Each calendar spans a month, with random routines plus weekday
+//       repeating templates; tasks have windows of three days
+
+#include "pch.h"
+
+#include <algorithm>
+
+#include "bench.h"
+
+namespace bench {
+    const int ARRANGE_ROUTINES_COUNT = 400;
+    const int ARRANGE_TEMPLATES_COUNT = 10;
+    const int ARRANGE_RUNS_COUNT = 20;
+
+    // Creates a user with a synthetic calendar
+    ::winrt::guid make_calendar(CoreAppModel const& model, uint64_t& random_state) {
+        auto user_ids = make_users(model, 1);
+        RoutineBatch batch;
+        for (int i = 0; i < ARRANGE_ROUTINES_COUNT; i++) {
+            uint64_t start = BASE_SECS_SINCE_EPOCH + next_random(random_state) % (31 * SECS_PER_DAY);
+            batch.updates.push_back(make_routine(start, 900 + next_random(random_state) % 5400));
+        }
+        for (int i = 0; i < ARRANGE_TEMPLATES_COUNT; i++) {
+            batch.updates.push_back(
+                make_weekly_template(BASE_SECS_SINCE_EPOCH - 30 * SECS_PER_DAY + i * 5000, 3600, 5)
+            );
+        }
+        model->try_apply_routine_batch(user_ids[0], batch);
+        return user_ids[0];
+    }
+
+    void run_arrange_tasks(void) {
+        std::printf("tasks | ms per arrangement (median) | placed\n");
+        for (int tasks_count : { 100, 300, 1000, 3000 }) {
+            std::vector<double> timings;
+            size_t placed = 0;
+            for (int run = 0; run < ARRANGE_RUNS_COUNT; run++) {
+                uint64_t random_state = run + 1;
+                auto model = RoutineArranger::make<CoreAppModel>();
+                auto user_id = make_calendar(model, random_state);
+                std::vector<FlexibleTaskDesc> tasks;
+                for (int i = 0; i < tasks_count; i++) {
+                    uint64_t earliest = BASE_SECS_SINCE_EPOCH + next_random(random_state) % (28 * SECS_PER_DAY);
+                    tasks.push_back(FlexibleTaskDesc{
+                        900 + next_random(random_state) % 3600, earliest, earliest + 3 * SECS_PER_DAY,
+                        L"task", L"", 0, RoutineEndTriggerKind::Manual
+                    });
+                }
+                TaskArrangement arrangement;
+                auto begin = std::chrono::steady_clock::now();
+                model->try_arrange_tasks_for_user(user_id, tasks, arrangement);
+                timings.push_back(elapsed_ms(begin));
+                placed += arrangement.routines.size();
+            }
+            std::sort(timings.begin(), timings.end());
+            std::printf("%5d | %27.3f | %zu\n", tasks_count, timings[timings.size() / 2], placed / ARRANGE_RUNS_COUNT);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+// Runs the benchmarks named on the command line, or all of them
+// NOTE: Usage: RoutineArranger.Benchmarks [template_age] [stress_partitions] [arrange_tasks]
+
+#include "pch.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "bench.h"
+
+struct BenchmarkEntry {
+    const char* name;
+    void (*run)(void);
+};
+const BenchmarkEntry BENCHMARKS[] = {
+    { "template_age", bench::run_template_age },
+    { "stress_partitions", bench::run_stress_partitions },
+    { "arrange_tasks", bench::run_arrange_tasks },
+};
+
+int main(int argc, char* argv[]) {
+    std::vector<BenchmarkEntry const*> selected;
+    for (int i = 1; i < argc; i++) {
+        auto it = std::find_if(std::begin(BENCHMARKS), std::end(BENCHMARKS), [&](BenchmarkEntry const& e) {
+            return std::strcmp(e.name, argv[i]) == 0;
+        });
+        if (it == std::end(BENCHMARKS)) {
+            std::printf("Unknown benchmark: %s\nAvailable:", argv[i]);
+            for (auto const& e : BENCHMARKS) {
+                std::printf(" %s", e.name);
+            }
+            std::printf("\n");
+            return 1;
+        }
+        selected.push_back(&*it);
+    }
+    if (selected.empty()) {
+        for (auto const& e : BENCHMARKS) {
+            selected.push_back(&e);
+        }
+    }
+    for (auto const* e : selected) {
+        std::printf("== %s ==\n", e->name);
+        e->run();
+        std::printf("\n");
+    }
+    return 0;
+}
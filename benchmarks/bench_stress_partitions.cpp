@@ -0,0 +1,90 @@
+// Benchmark: throughput of mixed per-user reads and writes as the number
+// of threads grows
+// NOTE: In the "disjoint" mode every thread works on its own users, which
+//       never contend; in the "shared" mode all threads work on a single
+//       user, for comparison
+// NOTE: Speed-up can only show on hardware with several cores; the number
+//       of hardware threads is printed along with the results
+
+#include "pch.h"
+
+#include <atomic>
+#include <thread>
+
+#include "bench.h"
+
+namespace bench {
+    const size_t STRESS_USERS_COUNT = 64;
+    const int STRESS_ROUTINES_PER_USER = 500;
+    // NOTE: One write per this many operations
+    const int STRESS_WRITE_INTERVAL = 10;
+    const auto STRESS_RUN_DURATION = std::chrono::milliseconds(1000);
+
+    RoutineDesc make_stress_routine(uint64_t seed) {
+        return make_routine(
+            BASE_SECS_SINCE_EPOCH + (seed * 7919) % (90 * SECS_PER_DAY),
+            900 + seed % 3600
+        );
+    }
+
+    // Returns operations completed per second
+    double run_stress_threads(
+        CoreAppModel const& model,
+        std::vector<::winrt::guid> const& user_ids,
+        unsigned threads_count,
+        bool shared
+    ) {
+        std::atomic<bool> is_stopped{ false };
+        std::atomic<uint64_t> total_ops{ 0 };
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < threads_count; t++) {
+            threads.emplace_back([&, t] {
+                std::vector<RoutineDesc> routines;
+                uint64_t ops = 0;
+                for (uint64_t i = 0; !is_stopped.load(std::memory_order_relaxed); i++) {
+                    // Threads take turns over disjoint sets of users
+                    size_t user_idx = shared ? 0 : (t + i * threads_count) % user_ids.size();
+                    auto const& user_id = user_ids[user_idx];
+                    if (i % STRESS_WRITE_INTERVAL == 0) {
+                        model->try_update_routine_from_user_view(user_id, make_stress_routine(i * 31 + t));
+                    }
+                    else {
+                        uint64_t day_start = BASE_SECS_SINCE_EPOCH + (i % 90) * SECS_PER_DAY;
+                        model->try_get_routines_from_user_view(user_id, day_start, day_start + SECS_PER_DAY, routines);
+                    }
+                    ops++;
+                }
+                total_ops += ops;
+            });
+        }
+        std::this_thread::sleep_for(STRESS_RUN_DURATION);
+        is_stopped = true;
+        for (auto& i : threads) {
+            i.join();
+        }
+        return total_ops / std::chrono::duration<double>(STRESS_RUN_DURATION).count();
+    }
+
+    void run_stress_partitions(void) {
+        std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+        std::printf("mode     | threads | ops/s total | ops/s per thread\n");
+        for (bool shared : { false, true }) {
+            for (unsigned threads_count : { 1, 2, 4, 8, 16 }) {
+                // NOTE: A fresh model per run, so that runs do not grow each other
+                auto model = RoutineArranger::make<CoreAppModel>();
+                auto user_ids = make_users(model, STRESS_USERS_COUNT);
+                for (auto const& user_id : user_ids) {
+                    RoutineBatch batch;
+                    for (int i = 0; i < STRESS_ROUTINES_PER_USER; i++) {
+                        batch.updates.push_back(make_stress_routine(i));
+                    }
+                    model->try_apply_routine_batch(user_id, batch);
+                }
+                double ops = run_stress_threads(model, user_ids, threads_count, shared);
+                std::printf("%-8s | %7u | %11.0f | %16.0f\n",
+                    shared ? "shared" : "disjoint", threads_count, ops, ops / threads_count
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,41 @@
+// Benchmark: latency of day-cell queries against repeating templates of
+// growing age
+// NOTE: Expansion jumps directly to the first relevant cycle, so latency
+//       should stay flat as templates grow older
+
+#include "pch.h"
+
+#include "bench.h"
+
+namespace bench {
+    const int AGE_TEMPLATES_COUNT = 50;
+    const int AGE_QUERIES_COUNT = 20000;
+
+    void run_template_age(void) {
+        std::printf("template age (years) | us per day-cell query\n");
+        for (uint64_t years : { 0, 1, 3, 10, 30, 50 }) {
+            auto model = RoutineArranger::make<CoreAppModel>();
+            auto user_ids = make_users(model, 1);
+            uint64_t template_start = BASE_SECS_SINCE_EPOCH - years * 365 * SECS_PER_DAY;
+            for (int i = 0; i < AGE_TEMPLATES_COUNT; i++) {
+                model->try_update_routine_from_user_view(
+                    user_ids[0], make_weekly_template(template_start + i * 600, 3600, 5)
+                );
+            }
+
+            // NOTE: Queried through a snapshot, so that the range cache of the
+            //       model does not hide the cost of expansion
+            auto snapshot = model->snapshot();
+            std::vector<RoutineDesc> routines;
+            size_t total = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (int i = 0; i < AGE_QUERIES_COUNT; i++) {
+                uint64_t day_start = BASE_SECS_SINCE_EPOCH + (i % 3650) * SECS_PER_DAY;
+                snapshot->try_get_routines_from_user_view(user_ids[0], day_start, day_start + SECS_PER_DAY, routines);
+                total += routines.size();
+            }
+            double us = elapsed_ms(begin) * 1000 / AGE_QUERIES_COUNT;
+            std::printf("%20llu | %8.2f (%zu routines)\n", static_cast<unsigned long long>(years), us, total);
+        }
+    }
+}
@@ -0,0 +1,149 @@
+// Regression tests of the core model
+// NOTE: Built by RoutineArranger.Tests.vcxproj as a console program, which
+//       exits with a non-zero code if any check fails
+
+#include "pch.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "RoutineArranger_Core.h"
+#include "util.h"
+
+using namespace RoutineArranger::Core;
+
+#define CHECK(expr) do {                                                    \
+    if (!(expr)) {                                                          \
+        std::printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #expr); \
+        g_failures++;                                                       \
+    }                                                                       \
+} while (0)
+
+int g_failures = 0;
+
+RoutineDesc make_routine(uint64_t start, uint64_t duration) {
+    RoutineDesc routine{};
+    routine.id = util::winrt::gen_random_guid();
+    routine.start_secs_since_epoch = start;
+    routine.duration_secs = duration;
+    routine.name = L"routine";
+    routine.end_trigger_kind = RoutineEndTriggerKind::Manual;
+    routine.template_options = nullptr;
+    return routine;
+}
+RoutineDesc make_daily_template(uint64_t start, uint64_t duration) {
+    RoutineDesc routine = make_routine(start, duration);
+    RoutineDescTemplate_Repeating repeating{};
+    repeating.repeat_days_cycle = 1;
+    // Repeat infinite times
+    repeating.repeat_cycles = 0;
+    repeating.repeat_days_flags = { true };
+    routine.template_options = repeating;
+    return routine;
+}
+
+// Inverted and empty ranges must not yield anything, not even occurrences
+// of repeating templates
+void test_empty_ranges(void) {
+    auto model = RoutineArranger::make<CoreAppModel>();
+    std::vector<::winrt::guid> user_ids;
+    CHECK(model->create_users({ NewUserDesc{ L"user", L"user", false } }, &user_ids));
+    auto user_id = user_ids[0];
+    CHECK(model->try_update_routine_from_user_view(user_id, make_daily_template(10 * SECS_PER_DAY + 3600, 1800)));
+    CHECK(model->try_update_routine_from_user_view(user_id, make_routine(19 * SECS_PER_DAY + 3600, 1800)));
+
+    std::vector<RoutineDesc> routines;
+    CHECK(model->try_get_routines_from_user_view(user_id, 19 * SECS_PER_DAY, 20 * SECS_PER_DAY, routines));
+    CHECK(routines.size() == 2);
+    for (auto [start, end] : { std::pair{ 20 * SECS_PER_DAY, 19 * SECS_PER_DAY }, std::pair{ 20 * SECS_PER_DAY, 20 * SECS_PER_DAY } }) {
+        routines.clear();
+        CHECK(!model->try_get_routines_from_user_view(user_id, start, end, routines));
+        CHECK(routines.empty());
+        size_t visited = 0;
+        CHECK(!model->try_visit_routines_from_user_view(user_id, start, end, [&](RoutineView const&) { visited++; }));
+        CHECK(visited == 0);
+        std::vector<RoutineConflict> conflicts;
+        CHECK(!model->try_get_routine_conflicts_from_user_view(user_id, start, end, conflicts));
+        FreeSlotQuery query{ start, end, 0, 0, 0, 0, 0 };
+        std::vector<std::pair<uint64_t, uint64_t>> slots;
+        CHECK(!model->try_find_free_slots_from_user_view(user_id, query, slots));
+        CHECK(!model->try_find_common_free_slots(user_ids, query, slots));
+    }
+}
+
+// Cached results are shared by nearby ranges, but must still match the
+// range asked for
+void test_range_cache_buckets(void) {
+    auto model = RoutineArranger::make<CoreAppModel>();
+    std::vector<::winrt::guid> user_ids;
+    CHECK(model->create_users({ NewUserDesc{ L"user", L"user", false } }, &user_ids));
+    auto user_id = user_ids[0];
+    CHECK(model->try_update_routine_from_user_view(user_id, make_daily_template(10 * SECS_PER_DAY + 3600, 1800)));
+    for (uint64_t i = 0; i < 40; i++) {
+        CHECK(model->try_update_routine_from_user_view(user_id, make_routine(10 * SECS_PER_DAY + i * 20000, i % 4 * 9000)));
+    }
+    auto snapshot = model->snapshot();
+    uint64_t hits = model->get_range_cache_stats().hits;
+    // NOTE: Windows not aligned to days, as with time zones
+    for (uint64_t day = 12; day < 18; day++) {
+        uint64_t start = day * SECS_PER_DAY - 5 * 3600;
+        std::vector<RoutineDesc> cached, expected;
+        CHECK(model->try_get_routines_from_user_view(user_id, start, start + SECS_PER_DAY, cached));
+        CHECK(snapshot->try_get_routines_from_user_view(user_id, start, start + SECS_PER_DAY, expected));
+        CHECK(cached.size() == expected.size());
+        for (auto const& i : cached) {
+            CHECK(std::any_of(expected.begin(), expected.end(), [&](RoutineDesc const& e) {
+                return e.id == i.id && e.start_secs_since_epoch == i.start_secs_since_epoch;
+            }));
+        }
+        std::vector<RoutineDaySummary> cached_summaries, expected_summaries;
+        CHECK(model->try_get_routine_day_summaries_from_user_view(user_id, start, 3, cached_summaries));
+        CHECK(snapshot->try_get_routine_day_summaries_from_user_view(user_id, start, 3, expected_summaries));
+        CHECK(cached_summaries.size() == 3 && expected_summaries.size() == 3);
+        for (size_t i = 0; i < cached_summaries.size() && i < expected_summaries.size(); i++) {
+            CHECK(cached_summaries[i].total_count == expected_summaries[i].total_count);
+            CHECK(cached_summaries[i].colors.size() == expected_summaries[i].colors.size());
+        }
+    }
+    CHECK(model->get_range_cache_stats().hits > hits);
+}
+
+// An occurrence of a template being edited must not conflict with itself,
+// while other routines still do
+void test_conflicts_with_edited_ghost(void) {
+    auto model = RoutineArranger::make<CoreAppModel>();
+    std::vector<::winrt::guid> user_ids;
+    CHECK(model->create_users({ NewUserDesc{ L"user", L"user", false } }, &user_ids));
+    auto user_id = user_ids[0];
+    CHECK(model->try_update_routine_from_user_view(user_id, make_daily_template(10 * SECS_PER_DAY + 3600, 1800)));
+
+    std::vector<RoutineDesc> routines;
+    CHECK(model->try_get_routines_from_user_view(user_id, 12 * SECS_PER_DAY, 13 * SECS_PER_DAY, routines));
+    CHECK(routines.size() == 1 && routines[0].is_ghost);
+    if (routines.size() != 1) {
+        return;
+    }
+    // Moved a little, so that it still overlaps where it was
+    RoutineDesc ghost = routines[0];
+    ghost.start_secs_since_epoch += 600;
+    std::vector<RoutineDesc> conflicts;
+    CHECK(model->try_get_conflicts_with_routine(user_id, ghost, conflicts));
+    CHECK(conflicts.empty());
+
+    auto other = make_routine(12 * SECS_PER_DAY + 4000, 1800);
+    CHECK(model->try_update_routine_from_user_view(user_id, other));
+    CHECK(model->try_get_conflicts_with_routine(user_id, ghost, conflicts));
+    CHECK(conflicts.size() == 1 && conflicts[0].id == other.id);
+}
+
+int main() {
+    test_empty_ranges();
+    test_range_cache_buckets();
+    test_conflicts_with_edited_ghost();
+    if (g_failures != 0) {
+        std::printf("%d check(s) failed\n", g_failures);
+        return 1;
+    }
+    std::printf("All tests passed\n");
+    return 0;
+}
@@ -121,6 +121,23 @@ namespace util {
                 }
             }
         }
+        // NOTE: v must not be 0
+        inline uint32_t count_trailing_zeros(uint64_t v) {
+#ifdef _MSC_VER
+            unsigned long idx;
+#ifdef _WIN64
+            _BitScanForward64(&idx, v);
+#else
+            if (!_BitScanForward(&idx, static_cast<unsigned long>(v))) {
+                _BitScanForward(&idx, static_cast<unsigned long>(v >> 32));
+                idx += 32;
+            }
+#endif
+            return static_cast<uint32_t>(idx);
+#else
+            return static_cast<uint32_t>(__builtin_ctzll(v));
+#endif
+        }
     }
 
     namespace fs {